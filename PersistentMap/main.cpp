@@ -6,10 +6,30 @@
 //  Copyright © 2015 MongoDB. All rights reserved.
 //
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <random>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "persistent_arena.h"
+#include "persistent_durable_map.h"
+#include "persistent_interval_map.h"
+#include "persistent_io.h"
 #include "persistent_map.h"
+#include "persistent_range_update_map.h"
+#include "persistent_set.h"
+#include "persistent_shared_value.h"
+#include "persistent_summary_map.h"
+#include "persistent_unordered_map.h"
+#include "persistent_vector.h"
+#include "persistent_view.h"
 
 #define invariant(_Expression)                     \
 do {                                               \
@@ -23,9 +43,346 @@ void invariantFailed(std::string message, std::string file, int line) {
         std::terminate();
 }
 
+std::string temp_path(const std::string& name) {
+    const char* dir = std::getenv("TMPDIR");
+    return std::string(dir ? dir : "/tmp") + "/persistent_map_" + name;
+}
+
 int main(int argc, const char * argv[]) {
     persistent::map<int, int> m;
     invariant(m.empty());
     invariant(m.size() == 0);
+    for (int i = 0; i < 1000; ++i) {
+        invariant(m.insert({(i * 7) % 1000, i}).second);
+    }
+    persistent::map<int, int> n = m;
+    invariant(!n.insert({7, 0}).second);
+    invariant(n.erase(7) == 1);
+    invariant(n.size() == 999 && !n.count(7));
+    invariant(m.size() == 1000 && m.at(7) == 1);
+    invariant(m.begin()[500].first == 500 && m.find(500) - m.begin() == 500);
+    invariant(n.pop_front().first == 0 && n.pop_back().first == 999 && n.size() == 997);
+    invariant(m.top_k(10).size() == 10 && m.top_k(10).rbegin()->first == 9);
+    invariant(n.upsert(7, [] { return 0; }, [](int v) { return v + 1; }) && n.at(7) == 0);
+    invariant(!n.upsert(7, [] { return 0; }, [](int v) { return v + 1; }) && n.at(7) == 1);
+    persistent::map<int, int> o = m;
+    invariant(o.update(8, [](int v) { return v; }) && &*o.find(8) == &*m.find(8));
+    invariant(o.update(8, [](int v) { return v + 1; }) && &*o.find(8) != &*m.find(8));
+    o = m;
+    invariant(!o.insert_or_assign(9, m.at(9)).second && &*o.find(9) == &*m.find(9));
+    invariant(!o.insert_or_assign(9, -1).second && o.at(9) == -1 && m.at(9) != -1);
+
+    std::mt19937 rng;
+    invariant(m.count(m.sample(rng)->first));
+    std::vector<persistent::map<int, int>::const_iterator> sample;
+    m.sample_k(100, rng, std::back_inserter(sample));
+    invariant(sample.size() == 100 && sample.front() < sample.back());
+
+    int sum = 0;
+    auto page = m.page(m.begin() + 10, 5, [&](const std::pair<const int, int>& x) { sum += x.first; });
+    invariant(sum == 10 + 11 + 12 + 13 + 14 && page - m.begin() == 15);
+    invariant(m.page(m.begin() + 990, SIZE_MAX, [](const std::pair<const int, int>&) {}) == m.end());
+    invariant(m.resume(m.token(page)) == page && o.resume(m.token(page))->first == 15);
+    o = m;
+    o.erase(14);
+    o.erase(3);
+    invariant(o.resume(m.token(page))->first == 15 && o.resume(m.token(m.end())) == o.end());
+    typedef persistent::codec<persistent::map<int, int>::page_token> token_codec;
+    std::stringstream token;
+    token_codec::write(token, m.token(page));
+    invariant(m.resume(token_codec::read(token)) == page);
+    token.str(std::string(1, '\x7f'));
+    bool rejected = false;
+    try {
+        token_codec::read(token);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    invariant(rejected);
+    invariant(!n.erase_if(8, [](int v) { return v < 0; }) && n.erase_if(8, [](int) { return true; }));
+
+    o = m;
+    o.insert_or_assign(500, -1);
+    o.erase(501);
+    int changed = 0;
+    co_iterate(m, o, [&](const std::pair<const int, int>* x, const std::pair<const int, int>* y) {
+        changed += !x || !y || x->second != y->second;
+    });
+    invariant(changed == 2);
+
+    auto evens = persistent::view(m, 100, 200)
+                     .filter([](const std::pair<const int, int>& x) { return x.first % 2 == 0; })
+                     .transform([](const std::pair<const int, int>& x) { return x.first; });
+    int count = 0;
+    evens.for_each([&](int x) { count += x >= 100 && x < 200 && x % 2 == 0; });
+    invariant(count == 50 && *evens.begin() == 100);
+    invariant(persistent::view(m, 100, 200).slice(10, 20)[0].first == 110);
+
+    invariant(o.insert(std::pair<const int, int>(-1, 0)).second && o.emplace(-2, 0).second);
+    std::ostringstream saved;
+    persistent::save(m, saved);
+    invariant(saved.str().size() == sizeof(std::uint64_t) + m.size() * 2 * sizeof(int));
+    std::istringstream restored(saved.str());
+    invariant((persistent::load<persistent::map<int, int>>(restored) == m));
+
+    std::ostringstream little_endian;
+    persistent::codec<std::uint32_t>::write(little_endian, 0x01020304);
+    invariant(little_endian.str() == "\x04\x03\x02\x01");
+
+    std::string table_path = temp_path("table");
+    persistent::export_sorted(m, table_path, 256, 10);
+    invariant((persistent::import_sorted<persistent::map<int, int>>(table_path) == m));
+    persistent::sorted_table<persistent::map<int, int>> table(table_path);
+    int value = 0;
+    invariant(table.size() == m.size() && table.find(500, value) && value == m.at(500));
+    invariant(table.find(0, value) && value == m.at(0));
+    invariant(table.find(999, value) && value == m.at(999));
+    invariant(!table.find(-1, value) && !table.find(1000, value));
+    int rejected_files = 0;
+    {
+        std::fstream file(table_path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekg(-3 * std::streamoff(sizeof(std::uint64_t)), std::ios::end);
+        std::uint64_t bloom = persistent::codec<std::uint64_t>::read(file);
+        file.seekp(-2 * std::streamoff(sizeof(std::uint64_t)), std::ios::end);
+        persistent::codec<std::uint64_t>::write(file, m.size() - 1);
+        file.seekp(bloom);
+        persistent::codec<std::uint64_t>::write(file, std::uint64_t(-1));
+    }
+    try {
+        persistent::import_sorted<persistent::map<int, int>>(table_path);
+    } catch (const std::runtime_error&) {
+        ++rejected_files;
+    }
+    try {
+        persistent::sorted_table<persistent::map<int, int>> corrupt(table_path);
+    } catch (const std::runtime_error&) {
+        ++rejected_files;
+    }
+    persistent::map<int, int, std::greater<int>> reversed(m.begin(), m.end());
+    persistent::export_sorted(reversed, table_path, 256);
+    try {
+        persistent::import_sorted<persistent::map<int, int>>(table_path);
+    } catch (const std::runtime_error&) {
+        ++rejected_files;
+    }
+    try {
+        persistent::sorted_table<persistent::map<int, int>> unordered(table_path);
+    } catch (const std::runtime_error&) {
+        ++rejected_files;
+    }
+    invariant(rejected_files == 4);
+    std::remove(table_path.c_str());
+
+    std::string path = temp_path("save");
+    std::atomic<size_t> progress(0);
+    persistent::save_async(m, path, 3, &progress).get();
+    std::ifstream file(path, std::ios::binary);
+    invariant(progress == m.size() && (persistent::load<persistent::map<int, int>>(file) == m));
+    std::remove(path.c_str());
+    bool failed = false;
+    try {
+        persistent::save_async(m, temp_path("missing/save"), 3).get();
+    } catch (const std::exception&) {
+        failed = true;
+    }
+    invariant(failed);
+    std::stringstream descending;
+    persistent::save(persistent::map<int, int, std::greater<int>>{{1, 1}, {2, 2}}, descending);
+    failed = false;
+    try {
+        persistent::load<persistent::map<int, int>>(descending);
+    } catch (const std::runtime_error&) {
+        failed = true;
+    }
+    invariant(failed);
+    std::stringstream corrupt;
+    persistent::codec<std::uint64_t>::write(corrupt, std::uint64_t(-1));
+    invariant(persistent::codec<std::string>::read(corrupt).empty() && !corrupt);
+
+    typedef persistent::arena_allocator<std::pair<const int, int>> arena_allocator;
+    persistent::arena nodes(1);
+    invariant(nodes.kind() == persistent::arena::no_pages);
+    arena_allocator pool(nodes);
+    persistent::map<int, int, std::less<int>, arena_allocator> huge(std::less<int>(), pool);
+    for (int i = 0; i < 1000; ++i) {
+        invariant(huge.insert({i, i}).second);
+    }
+    auto smaller = huge;
+    invariant(smaller.erase(7) && smaller.size() == 999 && huge.at(7) == 7);
+    invariant(huge.get_allocator() == pool && nodes.kind() != persistent::arena::no_pages);
+
+    persistent::map<int, persistent::shared_value<std::string>> docs;
+    for (int i = 0; i < 1000; ++i) {
+        docs.insert_or_assign(i, std::string(1000, 'x'));
+    }
+    auto edited = docs;
+    edited.insert_or_assign(500, std::string("y"));
+    invariant(edited.erase(10) && *edited.at(500) == "y" && docs.at(500)->size() == 1000);
+    for (int i = 0; i < 1000; ++i) {
+        invariant(i == 10 || i == 500 || shares(edited.at(i), docs.at(i)));
+    }
+    std::ostringstream saved_docs;
+    persistent::save(docs, saved_docs);
+    std::istringstream restored_docs(saved_docs.str());
+    invariant((persistent::load<decltype(docs)>(restored_docs) == docs));
+
+    persistent::map<std::string, int> names;
+    for (int i = 0; i < 1000; ++i) {
+        invariant(names.insert({"customer/" + std::to_string(i), i}).second);
+    }
+    invariant(names.insert({std::string("a\0", 2), -1}).second && names.insert({"a", -2}).second);
+    invariant(names.begin()->second == -2 && names.at(std::string("a\0", 2)) == -1);
+    invariant(names.at("customer/500") == 500 && !names.count("customer/1000"));
+    invariant(names.lower_bound("customer/5")->second == 5 && names.erase("customer/5") == 1);
+    invariant(names.upper_bound("customer/4")->first == "customer/40");
+
+    std::string db = temp_path("durable");
+    {
+        persistent::durable_map<int, int> d(db);
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t) {
+            writers.emplace_back([&d, t] {
+                for (int i = 0; i < 100; ++i) {
+                    d.insert_or_assign(t * 100 + i, i);
+                }
+            });
+        }
+        for (std::thread& t : writers) {
+            t.join();
+        }
+        d.erase(0);
+        invariant(d.snapshot().size() == 399);
+    }
+    {
+        persistent::map<int, int> recovered = persistent::durable_map<int, int>(db).snapshot();
+        invariant(recovered.size() == 399 && recovered.at(101) == 1 && !recovered.count(0));
+    }
+    std::ofstream(db + ".log.0", std::ios::binary | std::ios::app) << "torn";
+    {
+        persistent::durable_map<int, int> d(db);
+        invariant(d.snapshot().size() == 399);
+        d.insert_or_assign(-1, -1);
+    }
+    {
+        persistent::durable_map<int, int> d(db);
+        invariant(d.snapshot().size() == 400 && d.snapshot().at(-1) == -1);
+        d.checkpoint();
+        d.insert_or_assign(-2, -2);
+    }
+    {
+        persistent::map<int, int> recovered = persistent::durable_map<int, int>(db).snapshot();
+        invariant(recovered.size() == 401 && recovered.at(-1) == -1 && recovered.at(-2) == -2);
+        invariant(!std::ifstream(db + ".log.0") && std::ifstream(db + ".log.1"));
+    }
+    std::remove(db.c_str());
+    std::remove((db + ".log.1").c_str());
+    {
+        persistent::durable_map<int, int> d(db);
+        persistent::durable_map<int, int>::batch b;
+        for (int i = 0; i < 20000; ++i) {
+            b.insert_or_assign(i, i);
+        }
+        d.commit(b);
+        auto start = std::chrono::steady_clock::now();
+        d.checkpoint(1 << 20);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        invariant(elapsed.count() >= 20000 * 2 * sizeof(int) / double(1 << 20));
+    }
+    invariant((persistent::durable_map<int, int>(db).snapshot().size() == 20000));
+    std::remove(db.c_str());
+    std::remove((db + ".log.1").c_str());
+
+    persistent::multimap<int, int> mm{{1, 1}, {2, 2}, {1, 3}};
+    invariant(mm.count(1) == 2 && mm.find(1)->second == 1);
+    invariant(mm.erase(1) == 2 && mm.size() == 1);
+
+    persistent::set<int> s{3, 1, 2, 1};
+    invariant(s.size() == 3 && *s.begin() == 1 && *s.rbegin() == 3);
+
+    persistent::interval_map<int, int> im;
+    for (int i = 0; i < 100; ++i) {
+        im.insert({{i, i + 10}, i});
+    }
+    int found = 0;
+    im.for_each_containing(50, [&](const std::pair<const std::pair<int, int>, int>& x) {
+        invariant(x.first.first <= 50 && 50 < x.first.second);
+        ++found;
+    });
+    invariant(found == 10);
+
+    persistent::summary_map<int, double, persistent::quantile_sketch<>> latencies;
+    for (int i = 0; i < 1000; ++i) {
+        latencies.insert({i, double(i % 100)});
+    }
+    invariant(latencies.summarize().count() == 1000);
+    invariant(latencies.summarize(100, 300).count() == 200);
+    double median = latencies.summarize(100, 300).quantile(0.5);
+    invariant(median > 45 && median < 55);
+
+    persistent::summary_map<int, double, persistent::weight_sum<>> weights;
+    for (int i = 0; i < 1000; ++i) {
+        weights.insert({i, i == 10 ? 1.0 : i == 20 ? 3.0 : 0.0});
+    }
+    int drawn[2] = {0, 0};
+    for (int i = 0; i < 4000; ++i) {
+        int key = weights.sample_weighted(rng)->first;
+        invariant(key == 10 || key == 20);
+        ++drawn[key == 20];
+    }
+    invariant(weights.summarize().weight() == 4);
+    invariant(drawn[1] > 2 * drawn[0] && drawn[1] < 4 * drawn[0]);
+
+    persistent::range_update_map<int, double> prices;
+    for (int i = 0; i < 1000; ++i) {
+        prices.insert({i, 1.0});
+    }
+    persistent::range_update_map<int, double> before = prices;
+    prices.apply_range(100, 900, persistent::affine<double>::scale(0.5));
+    prices.apply_range(0, 200, persistent::affine<double>::add(1));
+    invariant(prices.at(50) == 2 && prices.at(150) == 1.5 && prices.at(500) == 0.5);
+    invariant(prices.erase(150) && prices.at(149) == 1.5 && before.at(150) == 1);
+
+    persistent::unordered_map<int, int> u;
+    for (int i = 0; i < 1000; ++i) {
+        invariant(u.insert({i, i * i}).second);
+    }
+    persistent::unordered_map<int, int> v = u;
+    invariant(!v.insert({7, 0}).second);
+    invariant(v.erase(7) == 1);
+    invariant(v.size() == 999 && !v.count(7));
+    invariant(u.size() == 1000 && u.at(7) == 49);
+    invariant(!v.insert_or_assign(8, 0).second && v.at(8) == 0 && u.at(8) == 64);
+    invariant(v.insert_or_assign(7, 1).second && v.find(7)->second == 1 && v.find(1000) == v.end());
+    long total = 0;
+    u.for_each([&](const std::pair<const int, int>& x) { total += x.first; });
+    invariant(total == 999 * 1000 / 2);
+    invariant(std::distance(v.begin(), v.end()) == 1000 && v.insert({-1, 1}).first->first == -1);
+
+    struct colliding_hash {
+        size_t operator()(int x) const {
+            return x % 3;
+        }
+    };
+    persistent::unordered_map<int, int, colliding_hash> c;
+    for (int i = 0; i < 100; ++i) {
+        invariant(c.insert({i, i}).second);
+    }
+    invariant(!c.insert_or_assign(50, -50).second && c.at(50) == -50 && c.find(51)->second == 51);
+    for (int i = 0; i < 100; i += 2) {
+        invariant(c.erase(i) == 1);
+    }
+    int odd = 0;
+    c.for_each([&](const std::pair<const int, int>& x) { odd += x.first % 2; });
+    invariant(c.size() == 50 && odd == 50 && !c.count(50) && c.at(99) == 99);
+
+    persistent::vector<int> w;
+    for (int i = 0; i < 1000; ++i) {
+        w.push_back(i);
+    }
+    persistent::vector<int> x = w.slice(100, 200);
+    x.append(w);
+    x.set(0, -1);
+    invariant(x.size() == 1100 && x[0] == -1 && x[1] == 101 && x[100] == 0);
+    invariant(w.size() == 1000 && w[100] == 100);
     return 0;
 }
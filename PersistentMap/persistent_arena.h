@@ -0,0 +1,236 @@
+//
+//  persistent_arena.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_ARENA_H
+#define PERSISTENT_ARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+namespace persistent {
+/**
+ * Memory for tree nodes, carved out of large chunks that are backed by huge pages where the
+ * system provides them, so that descending a large tree touches few TLB entries. Each chunk is
+ * first requested with MAP_HUGETLB, which needs pages reserved by the administrator. Failing
+ * that, it is mapped normally, aligned to the huge page size and advised with MADV_HUGEPAGE for
+ * transparent huge pages. Failing that as well, it stays on normal pages.
+ *
+ * Every thread allocates from a chunk of its own and keeps its own free lists, so allocating and
+ * freeing take no lock; only mapping a new chunk does. A block freed by another thread than the
+ * one that allocated it is reused by the freeing thread. Chunks are only returned to the system
+ * when the arena is destroyed, which must not happen before all containers using it are gone.
+ */
+class arena {
+public:
+    enum page_kind { no_pages, normal_pages, transparent_huge_pages, huge_tlb_pages };
+
+    /**
+     * Creates an arena mapping chunks of chunk_size bytes, rounded up to the huge page size.
+     */
+    explicit arena(size_t chunk_size = huge_page_size)
+        : _chunk_size((std::max<size_t>(chunk_size, 1) + huge_page_size - 1) / huge_page_size *
+                      huge_page_size),
+          _id(++last_id()),
+          _kind(no_pages) {}
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena() {
+        for (const chunk& c : _chunks)
+            ::munmap(c.first, c.second);
+    }
+
+    void* allocate(size_t bytes) {
+        bytes = round(bytes);
+        if (bytes > _chunk_size / 4)
+            return ::operator new(bytes);
+        cache& c = local();
+        size_t slot = bytes / alignment;
+        if (slot < c.free.size() && c.free[slot]) {
+            free_block* b = c.free[slot];
+            c.free[slot] = b->next;
+            return b;
+        }
+        if (size_t(c.end - c.next) < bytes) {
+            c.next = grow();
+            c.end = c.next + _chunk_size;
+        }
+        void* p = c.next;
+        c.next += bytes;
+        return p;
+    }
+
+    void deallocate(void* p, size_t bytes) {
+        bytes = round(bytes);
+        if (bytes > _chunk_size / 4) {
+            ::operator delete(p);
+            return;
+        }
+        cache& c = local();
+        size_t slot = bytes / alignment;
+        if (slot >= c.free.size())
+            c.free.resize(slot + 1);
+        c.free[slot] = new (p) free_block{c.free[slot]};
+    }
+
+    /**
+     * Returns the weakest kind of pages backing the chunks mapped so far, or no_pages if there
+     * are none yet.
+     */
+    page_kind kind() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _kind;
+    }
+
+private:
+    static const size_t alignment = alignof(std::max_align_t);
+    static const size_t huge_page_size = size_t(2) << 20;
+    static const size_t max_caches = 8;
+
+    struct free_block {
+        free_block* next;
+    };
+    typedef std::pair<void*, size_t> chunk;
+
+    /**
+     * The part of an arena owned by one thread. Arenas are told apart by an id that is never
+     * reused, so the cache of a destroyed arena is never mistaken for that of a new one.
+     */
+    struct cache {
+        std::uint64_t id;
+        char* next;
+        char* end;
+        std::vector<free_block*> free;
+    };
+
+    static std::atomic<std::uint64_t>& last_id() {
+        static std::atomic<std::uint64_t> id(0);
+        return id;
+    }
+
+    /**
+     * Returns the cache of this thread for this arena. A thread keeps caches for the last few
+     * arenas it used; evicting one merely leaves its free blocks unused until the arena is gone.
+     */
+    cache& local() {
+        static thread_local std::vector<cache> caches;
+        for (cache& c : caches)
+            if (c.id == _id)
+                return c;
+        if (caches.size() >= max_caches)
+            caches.erase(caches.begin());
+        caches.push_back(cache{_id, nullptr, nullptr, std::vector<free_block*>()});
+        return caches.back();
+    }
+
+    static size_t round(size_t bytes) {
+        return (std::max(bytes, sizeof(free_block)) + alignment - 1) / alignment * alignment;
+    }
+
+    char* grow() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        page_kind kind = huge_tlb_pages;
+        void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        p = ::mmap(nullptr,
+                   _chunk_size,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                   -1,
+                   0);
+#endif
+        if (p != MAP_FAILED) {
+            _chunks.push_back(chunk(p, _chunk_size));
+        } else {
+            kind = map_aligned(p);
+        }
+        _kind = _kind == no_pages ? kind : std::min(_kind, kind);
+        return static_cast<char*>(p);
+    }
+
+    /**
+     * Maps a chunk on normal pages, aligned to the huge page size so that transparent huge pages
+     * can back all of it, and returns the kind of pages it got.
+     */
+    page_kind map_aligned(void*& p) {
+        size_t size = _chunk_size + huge_page_size;
+        void* q = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (q == MAP_FAILED)
+            throw std::bad_alloc();
+        std::uintptr_t start = reinterpret_cast<std::uintptr_t>(q);
+        std::uintptr_t aligned = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+        if (aligned > start)
+            ::munmap(q, aligned - start);
+        if (aligned + _chunk_size < start + size)
+            ::munmap(reinterpret_cast<void*>(aligned + _chunk_size),
+                     start + size - aligned - _chunk_size);
+        p = reinterpret_cast<void*>(aligned);
+        _chunks.push_back(chunk(p, _chunk_size));
+#ifdef MADV_HUGEPAGE
+        if (::madvise(p, _chunk_size, MADV_HUGEPAGE) == 0)
+            return transparent_huge_pages;
+#endif
+        return normal_pages;
+    }
+
+    const size_t _chunk_size;
+    const std::uint64_t _id;
+    mutable std::mutex _mutex;
+    page_kind _kind;
+    std::vector<chunk> _chunks;
+};
+
+/**
+ * Allocator drawing from an arena, for use as the Allocator of the persistent containers. It is
+ * a plain pointer, so that the copy kept with every node costs a word and no reference counting;
+ * the arena must therefore outlive all containers, and all copies of them, that use it.
+ */
+template <class T>
+class arena_allocator {
+public:
+    typedef T value_type;
+
+    explicit arena_allocator(arena& a) : _arena(&a) {}
+    template <class U>
+    arena_allocator(const arena_allocator<U>& x) : _arena(x._arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(_arena->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        _arena->deallocate(p, n * sizeof(T));
+    }
+
+    arena* get_arena() const {
+        return _arena;
+    }
+
+private:
+    template <class U>
+    friend class arena_allocator;
+
+    arena* _arena;
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T>& x, const arena_allocator<U>& y) {
+    return x.get_arena() == y.get_arena();
+}
+template <class T, class U>
+bool operator!=(const arena_allocator<T>& x, const arena_allocator<U>& y) {
+    return !(x == y);
+}
+}
+
+#endif
@@ -0,0 +1,399 @@
+//
+//  persistent_durable_map.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_DURABLE_MAP_H
+#define PERSISTENT_DURABLE_MAP_H
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "persistent_io.h"
+#include "persistent_map.h"
+
+namespace persistent {
+/**
+ * Map whose updates are durable once the call making them returns. Each update is appended as a
+ * record to a write-ahead log, and concurrent updates share a single write and fsync: the first
+ * writer to find no flush in progress becomes the leader and flushes the records of all others
+ * that arrived meanwhile. The map itself lives in memory as a persistent::map, of which
+ * snapshot() returns the latest durable version in O(1).
+ *
+ * The log is kept in files path.log.N, and checkpoint() saves a snapshot to path, after which
+ * earlier logs are deleted. Opening recovers the map from the last checkpoint and the logs that
+ * follow it, ignoring an incomplete record at the end. Keys and values are encoded with codec.
+ */
+template <class Key,
+          class T,
+          class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class durable_map {
+public:
+    // types:
+    typedef map<Key, T, Compare, Allocator> map_type;
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<const Key, T> value_type;
+
+    /**
+     * Updates applied together: after a crash either all or none of them are recovered.
+     */
+    class batch {
+    public:
+        batch() : _count(0) {}
+
+        void insert_or_assign(const key_type& k, const T& obj) {
+            codec<std::uint8_t>::write(_ops, assign_op);
+            codec<Key>::write(_ops, k);
+            codec<T>::write(_ops, obj);
+            ++_count;
+        }
+        void erase(const key_type& k) {
+            codec<std::uint8_t>::write(_ops, erase_op);
+            codec<Key>::write(_ops, k);
+            ++_count;
+        }
+
+    private:
+        friend class durable_map;
+
+        std::ostringstream _ops;
+        std::uint32_t _count;
+    };
+
+    /**
+     * Opens the map stored at path, creating it if there is none.
+     */
+    explicit durable_map(const std::string& path)
+        : _path(path),
+          _gen(0),
+          _fd(-1),
+          _appended(0),
+          _durable(0),
+          _flushing(false),
+          _failed(false) {
+        std::ifstream is(path, std::ios::binary);
+        if (is) {
+            _gen = codec<std::uint64_t>::read(is);
+            _map = load<map_type>(is);
+            if (!is)
+                throw std::runtime_error("persistent::durable_map: corrupt checkpoint " + path);
+        }
+        while (std::ifstream(log_name(_gen + 1)))
+            replay(log_name(_gen++));
+        replay(log_name(_gen));
+        _committed = _map;
+        open_log();
+    }
+    durable_map(const durable_map&) = delete;
+    durable_map& operator=(const durable_map&) = delete;
+    ~durable_map() {
+        ::close(_fd);
+    }
+
+    /**
+     * Returns the latest version of the map whose updates are all durable.
+     */
+    map_type snapshot() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _committed;
+    }
+
+    // modifiers:
+    void insert_or_assign(const key_type& k, const T& obj) {
+        batch b;
+        b.insert_or_assign(k, obj);
+        commit(b);
+    }
+    void erase(const key_type& k) {
+        batch b;
+        b.erase(k);
+        commit(b);
+    }
+    /**
+     * Applies the updates in b and returns once they are durable.
+     */
+    void commit(const batch& b) {
+        std::string payload;
+        {
+            std::ostringstream os;
+            codec<std::uint32_t>::write(os, b._count);
+            payload = os.str() + b._ops.str();
+        }
+        std::ostringstream record;
+        codec<std::uint64_t>::write(record, payload.size());
+        codec<std::uint64_t>::write(record, detail::fnv1a(payload));
+        record << payload;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::istringstream is(payload);
+        apply(is, _map);
+        _pending += record.str();
+        size_t seq = ++_appended;
+        while (_durable < seq)
+            flush(lock);
+    }
+
+    /**
+     * Saves the current version to path and deletes the logs it makes redundant. Updates
+     * continue while the snapshot is written, as they go to a new log. A nonzero
+     * bytes_per_second limits the rate of writing the snapshot, to leave I/O bandwidth for the
+     * log.
+     */
+    void checkpoint(size_t bytes_per_second = 0) {
+        std::lock_guard<std::mutex> serialize(_checkpoint_mutex);
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_flushing || !_pending.empty())
+            flush(lock);
+        map_type m = _map;
+        std::uint64_t gen = ++_gen;
+        ::close(_fd);
+        open_log();
+        lock.unlock();
+
+        std::string tmp = _path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), "open " + tmp);
+        try {
+            throttled_writer w(fd, tmp, bytes_per_second);
+            codec<std::uint64_t>::write(w._buffer, gen);
+            codec<std::uint64_t>::write(w._buffer, m.size());
+            m.for_each(m.begin(), m.end(), std::ref(w));
+            w.flush();
+            if (full_sync(fd))
+                throw std::system_error(errno, std::system_category(), "fsync " + tmp);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        if (std::rename(tmp.c_str(), _path.c_str()))
+            throw std::system_error(errno, std::system_category(), "rename " + tmp);
+        sync_dir();
+        std::remove(log_name(gen - 1).c_str());
+    }
+
+private:
+    enum : std::uint8_t { assign_op, erase_op };
+
+    /**
+     * Encodes elements and writes them to fd in chunks of 64 KiB. With a nonzero rate, each chunk
+     * is also synced, so that the device rather than just the page cache receives writes at that
+     * rate, and writing pauses whenever the bytes written so far run ahead of it.
+     */
+    struct throttled_writer {
+        throttled_writer(int fd, const std::string& name, size_t rate)
+            : _fd(fd), _name(name), _rate(rate), _start(std::chrono::steady_clock::now()),
+              _written(0) {}
+
+        void operator()(const value_type& x) {
+            codec<value_type>::write(_buffer, x);
+            if (_buffer.tellp() >= 65536)
+                flush();
+        }
+        void flush() {
+            std::string bytes = _buffer.str();
+            _buffer.str(std::string());
+            if (int error = write_all(_fd, bytes))
+                throw std::system_error(error, std::system_category(), "write " + _name);
+            _written += bytes.size();
+            if (!_rate)
+                return;
+            if (sync_data(_fd))
+                throw std::system_error(errno, std::system_category(), "fdatasync " + _name);
+            std::chrono::duration<double> due(double(_written) / _rate);
+            std::this_thread::sleep_until(
+                _start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+        }
+
+        int _fd;
+        const std::string& _name;
+        size_t _rate;
+        std::chrono::steady_clock::time_point _start;
+        std::ostringstream _buffer;
+        std::uint64_t _written;
+    };
+
+    std::string log_name(std::uint64_t gen) const {
+        return _path + ".log." + std::to_string(gen);
+    }
+
+    static void apply(std::istream& is, map_type& m) {
+        for (std::uint32_t n = codec<std::uint32_t>::read(is); n; --n) {
+            std::uint8_t op = codec<std::uint8_t>::read(is);
+            Key k = codec<Key>::read(is);
+            if (op == assign_op)
+                m.insert_or_assign(k, codec<T>::read(is));
+            else
+                m.erase(k);
+        }
+    }
+
+    /**
+     * Applies the complete records of the log at name to the map, and truncates it after the
+     * last of them, which is all a crash can leave incomplete.
+     */
+    void replay(const std::string& name) {
+        std::ifstream is(name, std::ios::binary);
+        if (!is)
+            return;
+        is.seekg(0, std::ios::end);
+        std::uint64_t size = is.tellg();
+        is.seekg(0);
+        std::uint64_t valid = 0;
+        for (;;) {
+            std::uint64_t length = codec<std::uint64_t>::read(is);
+            std::uint64_t sum = codec<std::uint64_t>::read(is);
+            if (!is || length > size - valid - 2 * sizeof(std::uint64_t))
+                break;
+            std::string payload(length, '\0');
+            is.read(&payload[0], length);
+            if (!is || detail::fnv1a(payload) != sum)
+                break;
+            std::istringstream ops(payload);
+            apply(ops, _map);
+            valid += 2 * sizeof(std::uint64_t) + length;
+        }
+        if (valid < size && ::truncate(name.c_str(), valid))
+            throw std::system_error(errno, std::system_category(), "truncate " + name);
+    }
+
+    void open_log() {
+        std::string name = log_name(_gen);
+        _fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (_fd < 0)
+            throw std::system_error(errno, std::system_category(), "open " + name);
+        sync_dir();
+    }
+
+    /**
+     * Writes all of bytes to fd, returning zero or the error that stopped it.
+     */
+    static int write_all(int fd, const std::string& bytes) {
+        for (size_t done = 0; done < bytes.size();) {
+            ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+            if (n < 0 && errno != EINTR)
+                return errno;
+            if (n > 0)
+                done += n;
+        }
+        return 0;
+    }
+
+    /**
+     * Syncs fd to stable storage. On macOS fsync only hands the data to the drive, which may hold
+     * it in a volatile cache, so F_FULLFSYNC is requested instead, with fsync as the fallback for
+     * file systems that do not support it.
+     */
+    static int full_sync(int fd) {
+#ifdef __APPLE__
+        if (::fcntl(fd, F_FULLFSYNC) == 0)
+            return 0;
+#endif
+        return ::fsync(fd);
+    }
+
+    /**
+     * Syncs the data written to fd, without the metadata fsync also flushes where the system
+     * allows that.
+     */
+    static int sync_data(int fd) {
+#ifdef __linux__
+        return ::fdatasync(fd);
+#else
+        return full_sync(fd);
+#endif
+    }
+
+    static void sync(const std::string& name) {
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0 || full_sync(fd)) {
+            int error = errno;
+            if (fd >= 0)
+                ::close(fd);
+            throw std::system_error(error, std::system_category(), "fsync " + name);
+        }
+        ::close(fd);
+    }
+
+    /**
+     * Syncs the directory holding path, which makes creating, renaming and removing files in it
+     * durable. Until then, a crash may lose a new log, or bring back a log after the checkpoint
+     * replacing it was lost.
+     */
+    void sync_dir() const {
+        size_t slash = _path.rfind('/');
+        sync(slash == std::string::npos ? "." : slash == 0 ? "/" : _path.substr(0, slash));
+    }
+
+    /**
+     * Waits for the flush in progress or, if there is none, writes and syncs all pending records
+     * as the leader. Called and returns with lock held.
+     */
+    void flush(std::unique_lock<std::mutex>& lock) {
+        if (_failed)
+            throw std::runtime_error("persistent::durable_map: log write failed");
+        if (_flushing) {
+            _flushed.wait(lock);
+            return;
+        }
+        _flushing = true;
+        std::string bytes;
+        bytes.swap(_pending);
+        size_t seq = _appended;
+        map_type m = _map;
+        lock.unlock();
+
+        int error = write_all(_fd, bytes);
+        if (!error && full_sync(_fd))
+            error = errno;
+
+        lock.lock();
+        _flushing = false;
+        if (error) {
+            _failed = true;
+        } else {
+            _durable = seq;
+            _committed = m;
+        }
+        _flushed.notify_all();
+        if (error)
+            throw std::system_error(error, std::system_category(), "write " + log_name(_gen));
+    }
+
+    const std::string _path;
+    std::uint64_t _gen;
+    int _fd;
+
+    mutable std::mutex _mutex;
+    std::mutex _checkpoint_mutex;
+    std::condition_variable _flushed;
+    map_type _map;
+    map_type _committed;
+    std::string _pending;
+    size_t _appended;
+    size_t _durable;
+    bool _flushing;
+    bool _failed;
+};
+}
+
+#endif
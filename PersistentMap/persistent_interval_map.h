@@ -0,0 +1,179 @@
+//
+//  persistent_interval_map.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_INTERVAL_MAP_H
+#define PERSISTENT_INTERVAL_MAP_H
+
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "persistent_tree.h"
+
+namespace persistent {
+namespace detail {
+/**
+ * Records the largest interval end in the subtree, so searches can skip subtrees whose
+ * intervals all end before the range of interest. Compare is default-constructed for each
+ * comparison, so it must be stateless.
+ */
+template <class Bound, class Compare>
+struct max_end {
+    template <class Node>
+    void update(const Node& n) {
+        _max = &n._v.first.second;
+        if (n._l && Compare()(*_max, *n._l->_max))
+            _max = n._l->_max;
+        if (n._r && Compare()(*_max, *n._r->_max))
+            _max = n._r->_max;
+    }
+
+    // Points into the node holding the largest end, which is kept alive by this subtree.
+    const Bound* _max;
+};
+}
+
+/**
+ * Map from half-open intervals [first, second) to values, ordered by start and then by end.
+ * Each node also tracks the largest end in its subtree, so searches for the k intervals that
+ * contain a point or overlap a range skip every subtree ending too early. That only bounds a
+ * search by O(k log n) in the worst case, as each reported interval may cost a descent of its
+ * own, though it comes close to O(log n + k) when intervals starting near each other also end
+ * near each other. Compare must be stateless: the ordering and the augmentation construct it
+ * where they need it rather than carrying a copy in every node.
+ */
+template <class Bound,
+          class T,
+          class Compare = std::less<Bound>,
+          class Allocator = std::allocator<std::pair<const std::pair<Bound, Bound>, T>>>
+class interval_map {
+    static_assert(std::is_empty<Compare>::value,
+                  "persistent::interval_map requires a stateless Compare");
+
+    typedef std::pair<Bound, Bound> interval;
+    typedef std::pair<const interval, T> value;
+    struct interval_compare {
+        bool operator()(const interval& x, const interval& y) const {
+            Compare comp;
+            return comp(x.first, y.first) || (!comp(y.first, x.first) && comp(x.second, y.second));
+        }
+    };
+    typedef detail::tree<interval,
+                         value,
+                         detail::select_first<value>,
+                         interval_compare,
+                         Allocator,
+                         detail::max_end<Bound, Compare>>
+        tree;
+    typedef typename tree::node node;
+
+public:
+    // types:
+    typedef interval key_type;
+    typedef T mapped_type;
+    typedef std::pair<const interval, T> value_type;
+    typedef Allocator allocator_type;
+    typedef typename tree::iterator iterator;
+    typedef typename tree::iterator const_iterator;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    explicit interval_map(const Allocator& a = Allocator()) : _t(interval_compare(), a){};
+
+    allocator_type get_allocator() const noexcept {
+        return _t.get_allocator();
+    }
+
+    // iterators:
+    const_iterator begin() const noexcept {
+        return _t.at(0);
+    }
+    const_iterator end() const noexcept {
+        return _t.at(size());
+    }
+
+    // capacity:
+    bool empty() const noexcept {
+        return size() == 0;
+    };
+    size_type size() const noexcept {
+        return _t.size();
+    };
+
+    // element access:
+    const T& at(const key_type& x) const {
+        size_type i = _t.find(x);
+        if (i == size())
+            throw std::out_of_range("persistent::interval_map::at");
+        return _t.at(i)->second;
+    }
+
+    // modifiers:
+    std::pair<iterator, bool> insert(const value_type& x) {
+        std::pair<size_t, bool> r = _t.insert(x, true);
+        return std::make_pair(_t.at(r.first), r.second);
+    }
+    size_type erase(const key_type& x) {
+        return _t.erase(x);
+    }
+    void swap(interval_map& x) {
+        _t.swap(x._t);
+    }
+    void clear() noexcept {
+        _t.clear();
+    }
+
+    // map operations:
+    const_iterator find(const key_type& x) const {
+        return _t.at(_t.find(x));
+    }
+    size_type count(const key_type& x) const {
+        return _t.find(x) != size();
+    }
+
+    // interval operations:
+    /**
+     * Calls f for each element whose interval contains point, in order.
+     */
+    template <class F>
+    void for_each_containing(const Bound& point, F f) const {
+        visit(_t.root(), point, point, true, f);
+    }
+
+    /**
+     * Calls f for each element whose interval overlaps [first, last), in order.
+     */
+    template <class F>
+    void for_each_overlapping(const Bound& first, const Bound& last, F f) const {
+        visit(_t.root(), first, last, false, f);
+    }
+
+private:
+    /**
+     * Visits the intervals [x, y) with x < last (or x <= last if closed) and first < y.
+     */
+    template <class F>
+    static void visit(const node* n, const Bound& first, const Bound& last, bool closed, F& f) {
+        Compare comp;
+        while (n && comp(first, *n->_max)) {
+            visit(n->left(), first, last, closed, f);
+            const Bound& start = n->_v.first.first;
+            if (closed ? comp(last, start) : !comp(start, last))
+                return;
+            if (comp(first, n->_v.first.second))
+                f(n->_v);
+            n = n->right();
+        }
+    }
+
+    tree _t;
+};
+}
+
+#endif
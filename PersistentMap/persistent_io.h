@@ -0,0 +1,542 @@
+//
+//  persistent_io.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_IO_H
+#define PERSISTENT_IO_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace persistent {
+namespace detail {
+template <size_t Size>
+struct unsigned_of_size;
+template <>
+struct unsigned_of_size<1> {
+    typedef std::uint8_t type;
+};
+template <>
+struct unsigned_of_size<2> {
+    typedef std::uint16_t type;
+};
+template <>
+struct unsigned_of_size<4> {
+    typedef std::uint32_t type;
+};
+template <>
+struct unsigned_of_size<8> {
+    typedef std::uint64_t type;
+};
+}
+
+/**
+ * Binary encoding of keys and values for saving maps. Arithmetic types are written as their bytes
+ * in little-endian order, strings with a length prefix, and pairs as their members in order. The
+ * encoding is the same on every host for types of the same size, so files meant for other
+ * platforms should use fixed-width types such as std::int64_t rather than long. Specialize this
+ * for other types, providing write(os, x) and read(is), which returns the value read.
+ */
+template <class T, class Enable = void>
+struct codec;
+
+template <class T>
+struct codec<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+    typedef typename detail::unsigned_of_size<sizeof(T)>::type bits;
+
+    static void write(std::ostream& os, const T& x) {
+        bits u;
+        std::memcpy(&u, &x, sizeof x);
+        char bytes[sizeof x];
+        for (size_t i = 0; i < sizeof x; ++i)
+            bytes[i] = char(u >> 8 * i);
+        os.write(bytes, sizeof bytes);
+    }
+    static T read(std::istream& is) {
+        char bytes[sizeof(T)] = {};
+        is.read(bytes, sizeof bytes);
+        bits u = 0;
+        for (size_t i = 0; i < sizeof bytes; ++i)
+            u |= bits(static_cast<unsigned char>(bytes[i])) << 8 * i;
+        T x;
+        std::memcpy(&x, &u, sizeof x);
+        return x;
+    }
+};
+
+template <>
+struct codec<std::string> {
+    static void write(std::ostream& os, const std::string& x) {
+        codec<std::uint64_t>::write(os, x.size());
+        os.write(x.data(), x.size());
+    }
+    /**
+     * Grows the string as its bytes arrive rather than allocating the whole length up front, so
+     * that a corrupt length fails at the end of the input instead of exhausting memory.
+     */
+    static std::string read(std::istream& is) {
+        std::uint64_t n = codec<std::uint64_t>::read(is);
+        std::string x;
+        while (is && x.size() < n) {
+            size_t size = x.size();
+            x.resize(size + size_t(std::min<std::uint64_t>(n - size, 1 << 16)));
+            is.read(&x[size], x.size() - size);
+            x.resize(size + size_t(is.gcount()));
+        }
+        return x;
+    }
+};
+
+template <class A, class B>
+struct codec<std::pair<A, B>> {
+    typedef typename std::remove_const<A>::type first_type;
+
+    static void write(std::ostream& os, const std::pair<A, B>& x) {
+        codec<first_type>::write(os, x.first);
+        codec<B>::write(os, x.second);
+    }
+    static std::pair<A, B> read(std::istream& is) {
+        first_type first = codec<first_type>::read(is);
+        return std::pair<A, B>(first, codec<B>::read(is));
+    }
+};
+
+template <class Key>
+struct page_token;
+
+/**
+ * Encodes a page token as a version byte followed by its rank and key, so that tokens held by
+ * clients across an upgrade are rejected rather than misread if the encoding ever changes.
+ */
+template <class Key>
+struct codec<page_token<Key>> {
+    enum { version = 1 };
+
+    static void write(std::ostream& os, const page_token<Key>& t) {
+        codec<std::uint8_t>::write(os, std::uint8_t(version));
+        codec<std::uint64_t>::write(os, t.rank);
+        codec<Key>::write(os, t.key);
+    }
+    static page_token<Key> read(std::istream& is) {
+        if (codec<std::uint8_t>::read(is) != version || !is)
+            throw std::runtime_error("persistent: unsupported page token");
+        std::uint64_t rank = codec<std::uint64_t>::read(is);
+        page_token<Key> t = {size_t(rank), codec<Key>::read(is)};
+        if (!is)
+            throw std::runtime_error("persistent: truncated page token");
+        return t;
+    }
+};
+
+namespace detail {
+/**
+ * 64-bit FNV-1a hash of a byte string, which unlike std::hash is the same on every platform.
+ */
+inline std::uint64_t fnv1a(const std::string& bytes) {
+    std::uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : bytes)
+        h = (h ^ c) * 1099511628211ULL;
+    return h;
+}
+
+template <class Value>
+struct element_reader {
+    Value operator()() const {
+        Value x = codec<Value>::read(_is);
+        if (!_is)
+            throw std::runtime_error("persistent: truncated input");
+        return x;
+    }
+
+    std::istream& _is;
+};
+
+/**
+ * Reads elements like element_reader, checking that their keys strictly increase under Compare,
+ * which building a tree bottom-up takes on trust.
+ */
+template <class Value, class Compare>
+struct sorted_reader {
+    typedef typename std::remove_const<typename Value::first_type>::type key_type;
+
+    Value operator()() {
+        Value x = _next();
+        if (_read++ && !_comp(_last, x.first))
+            throw std::runtime_error("persistent: keys out of order");
+        _last = x.first;
+        return x;
+    }
+
+    element_reader<Value> _next;
+    Compare _comp;
+    key_type _last;
+    std::uint64_t _read;
+};
+
+template <class Value>
+struct element_writer {
+    void operator()(const Value& x) const {
+        codec<Value>::write(_os, x);
+        if (_progress)
+            ++*_progress;
+    }
+
+    std::ostream& _os;
+    std::atomic<size_t>* _progress;
+};
+}
+
+/**
+ * Writes the size of m followed by its elements in order.
+ */
+template <class Map>
+void save(const Map& m, std::ostream& os, std::atomic<size_t>* progress = nullptr) {
+    codec<std::uint64_t>::write(os, m.size());
+    detail::element_writer<typename Map::value_type> w = {os, progress};
+    m.for_each(m.begin(), m.end(), w);
+}
+
+/**
+ * Reads a map written by save(), building it bottom-up in O(n). Throws std::runtime_error if the
+ * input ends before the number of elements in its header, or if their keys are out of order.
+ */
+template <class Map>
+Map load(std::istream& is) {
+    Map m;
+    std::uint64_t n = codec<std::uint64_t>::read(is);
+    detail::sorted_reader<typename Map::value_type, typename Map::key_compare> next = {
+        {is}, m.key_comp(), typename Map::key_type(), 0};
+    if (is)
+        m.assign_sorted(n, next);
+    return m;
+}
+
+/**
+ * Saves snapshot to the file at path on a background thread, returning a future that becomes
+ * ready when the file is written, or holds the exception that stopped it. As the snapshot is an
+ * O(1) copy of an immutable version, writers may keep updating the map meanwhile. With chunks
+ * greater than one, up to that many ranges of at most 65536 elements are encoded in parallel, each
+ * on its own thread, and written in order as soon as all ranges before them are; so no more than
+ * chunks threads and encoded ranges exist at any time. If given, progress counts the elements
+ * encoded so far.
+ */
+template <class Map>
+std::future<void> save_async(const Map& snapshot,
+                             const std::string& path,
+                             size_t chunks = 1,
+                             std::atomic<size_t>* progress = nullptr) {
+    return std::async(std::launch::async, [=] {
+        std::ofstream os;
+        os.exceptions(std::ios::failbit | std::ios::badbit);
+        os.open(path, std::ios::binary | std::ios::trunc);
+        if (chunks <= 1) {
+            save(snapshot, os, progress);
+            return;
+        }
+        size_t n = snapshot.size();
+        size_t range = std::max<size_t>(1, std::min<size_t>(65536, (n + chunks - 1) / chunks));
+        codec<std::uint64_t>::write(os, n);
+        std::deque<std::future<std::string>> encoding;
+        for (size_t next = 0; next < n || !encoding.empty();) {
+            while (next < n && encoding.size() < chunks) {
+                typename Map::const_iterator first = snapshot.begin() + next;
+                next = std::min(n, next + range);
+                typename Map::const_iterator last = snapshot.begin() + next;
+                encoding.push_back(std::async(std::launch::async, [=] {
+                    std::ostringstream chunk;
+                    detail::element_writer<typename Map::value_type> w = {chunk, progress};
+                    snapshot.for_each(first, last, w);
+                    return chunk.str();
+                }));
+            }
+            std::string bytes = encoding.front().get();
+            encoding.pop_front();
+            os.write(bytes.data(), bytes.size());
+        }
+    });
+}
+
+namespace detail {
+const std::uint64_t sorted_file_magic = 0x7473726570746f73ULL;
+
+/**
+ * Bloom filter over encoded keys, probing k bits chosen by double hashing.
+ */
+class bloom_filter {
+public:
+    bloom_filter(std::uint64_t bits, std::uint32_t k) : _bits((bits + 7) / 8), _k(k) {}
+
+    template <class Key>
+    void add(const Key& x) {
+        std::uint64_t h = hash(x);
+        for (std::uint32_t i = 0; i < _k; ++i)
+            set(probe(h, i));
+    }
+    template <class Key>
+    bool may_contain(const Key& x) const {
+        std::uint64_t h = hash(x);
+        for (std::uint32_t i = 0; i < _k; ++i)
+            if (!test(probe(h, i)))
+                return false;
+        return true;
+    }
+
+    void write(std::ostream& os) const {
+        codec<std::uint64_t>::write(os, _bits.size());
+        codec<std::uint32_t>::write(os, _k);
+        os.write(_bits.data(), _bits.size());
+    }
+    /**
+     * Reads a filter from is, which holds at most limit bytes for it, checking its size against
+     * that before allocating.
+     */
+    static bloom_filter read(std::istream& is, std::uint64_t limit) {
+        std::uint64_t bytes = codec<std::uint64_t>::read(is);
+        std::uint32_t k = codec<std::uint32_t>::read(is);
+        if (!is || bytes == 0 || limit < 12 || bytes > limit - 12)
+            throw std::runtime_error("persistent: corrupt Bloom filter");
+        bloom_filter f(8 * bytes, k);
+        is.read(&f._bits[0], bytes);
+        return f;
+    }
+
+private:
+    template <class Key>
+    static std::uint64_t hash(const Key& x) {
+        std::ostringstream os;
+        codec<Key>::write(os, x);
+        return fnv1a(os.str());
+    }
+    std::uint64_t probe(std::uint64_t h, std::uint32_t i) const {
+        return (h + i * ((h >> 32) | 1)) % (8 * _bits.size());
+    }
+    void set(std::uint64_t bit) {
+        _bits[bit / 8] |= char(1 << bit % 8);
+    }
+    bool test(std::uint64_t bit) const {
+        return _bits[bit / 8] & (1 << bit % 8);
+    }
+
+    std::vector<char> _bits;
+    std::uint32_t _k;
+};
+
+/**
+ * Writes elements into blocks of about block_size bytes, recording the offset and first key of
+ * each block in the index.
+ */
+template <class Value>
+struct block_writer {
+    typedef typename std::remove_const<typename Value::first_type>::type key_type;
+
+    void operator()(const Value& x) {
+        std::uint64_t offset = _os.tellp();
+        if (offset >= _block + _block_size || !_blocks) {
+            codec<std::uint64_t>::write(_index, offset);
+            codec<key_type>::write(_index, x.first);
+            _block = offset;
+            ++_blocks;
+        }
+        codec<Value>::write(_os, x);
+        if (_bloom)
+            _bloom->add(x.first);
+    }
+
+    std::ostream& _os;
+    std::ostringstream& _index;
+    bloom_filter* _bloom;
+    std::uint64_t _block_size;
+    std::uint64_t _block;
+    std::uint64_t _blocks;
+};
+
+struct sorted_file_footer {
+    std::uint64_t index;
+    std::uint64_t blocks;
+    std::uint64_t bloom;
+    std::uint64_t size;
+    // The offset of the footer itself, which is not written but found when reading.
+    std::uint64_t end;
+
+    void write(std::ostream& os) const {
+        codec<std::uint64_t>::write(os, index);
+        codec<std::uint64_t>::write(os, blocks);
+        codec<std::uint64_t>::write(os, bloom);
+        codec<std::uint64_t>::write(os, size);
+        codec<std::uint64_t>::write(os, sorted_file_magic);
+    }
+    static sorted_file_footer read(std::istream& is, const std::string& path) {
+        is.seekg(-5 * std::streamoff(sizeof(std::uint64_t)), std::ios::end);
+        sorted_file_footer f;
+        f.end = is.tellg();
+        f.index = codec<std::uint64_t>::read(is);
+        f.blocks = codec<std::uint64_t>::read(is);
+        f.bloom = codec<std::uint64_t>::read(is);
+        f.size = codec<std::uint64_t>::read(is);
+        if (!is || codec<std::uint64_t>::read(is) != sorted_file_magic)
+            throw std::runtime_error("persistent: not a sorted file: " + path);
+        if (f.index > f.end || (f.bloom && (f.bloom < f.index || f.bloom >= f.end)) ||
+            f.blocks > f.size || (f.size && !f.blocks))
+            throw std::runtime_error("persistent: corrupt footer in " + path);
+        return f;
+    }
+};
+}
+
+/**
+ * Writes m to the file at path as a sorted table for use by other processes and hosts:
+ *
+ *   blocks  elements encoded with codec in key order, in blocks of about block_size bytes
+ *   index   for each block, its offset and first key
+ *   bloom   if bloom_bits_per_key is nonzero, a Bloom filter of the keys
+ *   footer  offsets of index and bloom (or 0), the number of blocks and of elements, and a magic
+ *           number
+ *
+ * Elements are streamed from the snapshot, so only the index and the Bloom filter are held in
+ * memory.
+ */
+template <class Map>
+void export_sorted(const Map& m,
+                   const std::string& path,
+                   size_t block_size = 4096,
+                   size_t bloom_bits_per_key = 0) {
+    std::ofstream os;
+    os.exceptions(std::ios::failbit | std::ios::badbit);
+    os.open(path, std::ios::binary | std::ios::trunc);
+
+    std::ostringstream index;
+    detail::bloom_filter bloom(std::max<std::uint64_t>(64, m.size() * bloom_bits_per_key),
+                               std::max<std::uint32_t>(1, bloom_bits_per_key * 69 / 100));
+    detail::block_writer<typename Map::value_type> w = {
+        os, index, bloom_bits_per_key ? &bloom : nullptr, block_size, 0, 0};
+    m.for_each(m.begin(), m.end(), std::ref(w));
+
+    detail::sorted_file_footer footer = {0, w._blocks, 0, m.size(), 0};
+    footer.index = os.tellp();
+    os << index.str();
+    if (bloom_bits_per_key) {
+        footer.bloom = os.tellp();
+        bloom.write(os);
+    }
+    footer.write(os);
+}
+
+/**
+ * Reads a map written by export_sorted(), streaming its elements into a tree built bottom-up in
+ * O(n). Throws std::runtime_error if the keys are out of order or the elements do not end where
+ * the index begins, as they do when the footer has the wrong count.
+ */
+template <class Map>
+Map import_sorted(const std::string& path) {
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+        throw std::runtime_error("persistent::import_sorted: cannot open " + path);
+    detail::sorted_file_footer footer = detail::sorted_file_footer::read(is, path);
+    is.seekg(0);
+    Map m;
+    detail::sorted_reader<typename Map::value_type, typename Map::key_compare> next = {
+        {is}, m.key_comp(), typename Map::key_type(), 0};
+    m.assign_sorted(footer.size, next);
+    if (std::uint64_t(is.tellg()) != footer.index)
+        throw std::runtime_error("persistent::import_sorted: wrong element count in " + path);
+    return m;
+}
+
+/**
+ * Reader for a file written by export_sorted(), which loads the index and Bloom filter once when
+ * opened. Each lookup then checks the filter, binary searches the index for the only block that
+ * may hold the key, and scans that block, so it reads one block from the file. A table reads
+ * through its own stream, so it must not be used by several threads at once.
+ */
+template <class Map>
+class sorted_table {
+public:
+    // types:
+    typedef typename Map::key_type key_type;
+    typedef typename Map::mapped_type mapped_type;
+    typedef typename Map::value_type value_type;
+    typedef typename Map::key_compare key_compare;
+    typedef size_t size_type;
+
+    explicit sorted_table(const std::string& path)
+        : _is(path, std::ios::binary), _bloom(0, 0) {
+        if (!_is)
+            throw std::runtime_error("persistent::sorted_table: cannot open " + path);
+        _footer = detail::sorted_file_footer::read(_is, path);
+        _is.seekg(_footer.index);
+        for (std::uint64_t i = 0; _is && i < _footer.blocks; ++i) {
+            std::uint64_t offset = codec<std::uint64_t>::read(_is);
+            key_type key = codec<key_type>::read(_is);
+            if (i ? offset <= _offsets.back() || !_comp(_keys.back(), key) : offset != 0)
+                throw std::runtime_error("persistent::sorted_table: corrupt index in " + path);
+            _offsets.push_back(offset);
+            _keys.push_back(key);
+        }
+        if (!_offsets.empty() && _offsets.back() >= _footer.index)
+            throw std::runtime_error("persistent::sorted_table: corrupt index in " + path);
+        if (_is && _footer.bloom) {
+            _is.seekg(_footer.bloom);
+            _bloom = detail::bloom_filter::read(_is, _footer.end - _footer.bloom);
+        }
+        if (!_is)
+            throw std::runtime_error("persistent::sorted_table: truncated " + path);
+    }
+
+    size_type size() const {
+        return _footer.size;
+    }
+
+    /**
+     * Returns true and sets value if x is in the table.
+     */
+    bool find(const key_type& x, mapped_type& value) {
+        if (_footer.bloom && !_bloom.may_contain(x))
+            return false;
+        // The block that may hold x is the last one whose first key is not greater than x.
+        size_t block = std::upper_bound(_keys.begin(), _keys.end(), x, _comp) - _keys.begin();
+        if (block == 0)
+            return false;
+        std::uint64_t last = block < _offsets.size() ? _offsets[block] : _footer.index;
+        _is.clear();
+        _is.seekg(_offsets[block - 1]);
+        while (_is && std::uint64_t(_is.tellg()) < last) {
+            value_type v = codec<value_type>::read(_is);
+            if (!_comp(v.first, x)) {
+                if (_comp(x, v.first))
+                    return false;
+                value = v.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::ifstream _is;
+    detail::sorted_file_footer _footer;
+    std::vector<std::uint64_t> _offsets;
+    std::vector<key_type> _keys;
+    detail::bloom_filter _bloom;
+    key_compare _comp;
+};
+}
+
+#endif
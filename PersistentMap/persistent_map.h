@@ -6,64 +6,50 @@
 //  Copyright © 2015 MongoDB. All rights reserved.
 //
 
+#ifndef PERSISTENT_MAP_H
+#define PERSISTENT_MAP_H
+
+#include <algorithm>
 #include <initializer_list>
 #include <iterator>
 #include <limits>
 #include <memory>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include "persistent_tree.h"
 
 namespace persistent {
+/**
+ * Resume token for paging: the rank and key of the last element of a page. Ranks shift as other
+ * versions insert or erase elements, so resuming checks the rank against the key and falls back
+ * to searching for the key. Either way resuming takes O(log n). persistent_io.h provides a codec
+ * for handing tokens to clients.
+ */
+template <class Key>
+struct page_token {
+    size_t rank;
+    Key key;
+};
+
 template <class Key,
           class T,
           class Compare = std::less<Key>,
           class Allocator = std::allocator<std::pair<const Key, T>>>
 class map {
-    struct node;
-    typedef std::shared_ptr<node> node_ptr;
     typedef std::pair<const Key, T> value;
-    struct node {
-        node(value v) : _v(v), _n(0) {}
-        node* left() {
-            return _l.get();
-        }
-        node* right() {
-            return _r.get();
-        }
-        /**
-         * Given a tree rooted at this, return a pointer to its i-th node (zero-based).
-         */
-        node* operator+(size_t rhs) const {
-            node* next = this;
-            node* current;
-            node* left;
-            do {
-                current = next;
-                next = next->right();  // until proven otherwise
-                left = next->left();
-
-                if (left) {
-                    if (rhs < left->_n) {
-                        next = left;
-                    } else {
-                        rhs -= left->_n;
-                    }
-                }
-            } while (rhs || next == left);
-            return current;
-        }
-
-        node& operator[](size_t idx)  {
-            return *(this + idx);
-        };
-
-        const node& operator[](size_t idx) const {
-            return *(this + idx);
-        };
-
-        value _v;
-        size_t _n;
-        node_ptr _l;
-        node_ptr _r;
-    };
+    typedef detail::select_first<value> key_of_value;
+    typedef detail::tree<Key,
+                         value,
+                         key_of_value,
+                         Compare,
+                         Allocator,
+                         typename detail::key_augment<Key, Compare, key_of_value>::type>
+        tree;
+    typedef typename tree::node_ptr node_ptr;
 
 public:
     // types:
@@ -74,8 +60,8 @@ public:
     typedef Allocator allocator_type;
     typedef value_type& reference;
     typedef const value_type& const_reference;
-    class iterator;
-    class const_iterator;
+    typedef typename tree::iterator iterator;
+    typedef typename tree::iterator const_iterator;
     typedef size_t size_type;
     typedef std::ptrdiff_t difference_type;
     typedef typename std::allocator_traits<Allocator>::pointer pointer;
@@ -83,93 +69,7 @@ public:
     typedef std::reverse_iterator<iterator> reverse_iterator;
     typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
-    class iterator : std::iterator<std::random_access_iterator_tag, node> {
-    public:
-        iterator(node* n, size_t index) : _index(index), _root(n) {}
-
-        iterator(const iterator& mit) : _index(mit._index), _root(mit._root) {}
-
-        iterator& operator++() {
-            ++_index;
-            return *this;
-        }
-        iterator& operator--() {
-            --_index;
-            return *this;
-        }
-        iterator operator++(int) {
-            iterator tmp(*this);
-            operator++();
-            return tmp;
-        }
-        iterator operator--(int) {
-            iterator tmp(*this);
-            operator--();
-            return tmp;
-        }
-        bool operator==(const iterator& rhs) {
-            return _index == rhs._index;
-        }
-        bool operator!=(const iterator& rhs) {
-            return _index != rhs._index;
-        }
-
-        reference operator*() const {
-            return _root[index];
-        }
-
-        pointer operator->() const {
-            return _root + index;
-        }
-
-    private:
-        size_t _index;
-        node* _root;
-    };
-
-    class const_iterator : std::iterator<std::random_access_iterator_tag, node> {
-    public:
-        const_iterator(node* n, size_t index) : _index(index), _root(n) {}
-
-        const_iterator(const iterator& mit) : _index(mit._index), _root(mit._root) {}
-
-        const_iterator& operator++() {
-            ++_index;
-            return *this;
-        }
-        const_iterator& operator--() {
-            --_index;
-            return *this;
-        }
-        const_iterator operator++(int) {
-            const_iterator tmp(*this);
-            operator++();
-            return tmp;
-        }
-        const_iterator operator--(int) {
-            const_iterator tmp(*this);
-            operator--();
-            return tmp;
-        }
-        bool operator==(const const_iterator& rhs) const {
-            return _index == rhs._index;
-        }
-        bool operator!=(const const_iterator& rhs) const {
-            return _index != rhs._index;
-        }
-
-        const_reference operator*() const {
-            return _root[index];
-        }
-
-        const_pointer operator->() const {
-            return _root + index;
-        }
-
-    private:
-        size_t _index;
-        node* _root;
-    };
+    typedef persistent::page_token<Key> page_token;
 
     class value_compare {
         friend class map;
@@ -187,44 +87,70 @@ public:
         }
     };
 
-    explicit map(const Compare& comp = Compare(), const Allocator& = Allocator()){};
+    explicit map(const Compare& comp = Compare(), const Allocator& a = Allocator())
+        : _t(comp, a){};
     template <class InputIterator>
     map(InputIterator first,
         InputIterator last,
         const Compare& comp = Compare(),
-        const Allocator& = Allocator());
-    map(const map<Key, T, Compare, Allocator>& x);
-    map(map<Key, T, Compare, Allocator>&& x);
-    explicit map(const Allocator&);
-    map(const map&, const Allocator&);
-    map(map&&, const Allocator&);
-    map(std::initializer_list<value_type>,
-        const Compare& = Compare(),
-        const Allocator& = Allocator());
+        const Allocator& a = Allocator())
+        : _t(comp, a) {
+        insert(first, last);
+    }
+    map(const map<Key, T, Compare, Allocator>& x) = default;
+    map(map<Key, T, Compare, Allocator>&& x) = default;
+    explicit map(const Allocator& a) : _t(Compare(), a){};
+    map(const map& x, const Allocator& a) : _t(x.key_comp(), a) {
+        insert(x.begin(), x.end());
+    }
+    map(std::initializer_list<value_type> il,
+        const Compare& comp = Compare(),
+        const Allocator& a = Allocator())
+        : _t(comp, a) {
+        insert(il);
+    }
 
     ~map() = default;
 
-    map<Key, T, Compare, Allocator>& operator=(const map<Key, T, Compare, Allocator>& x);
-    map<Key, T, Compare, Allocator>& operator=(map<Key, T, Compare, Allocator>&& x);
-    map& operator=(std::initializer_list<value_type>);
+    map<Key, T, Compare, Allocator>& operator=(const map<Key, T, Compare, Allocator>& x) = default;
+    map<Key, T, Compare, Allocator>& operator=(map<Key, T, Compare, Allocator>&& x) = default;
+    map& operator=(std::initializer_list<value_type> il) {
+        clear();
+        insert(il);
+        return *this;
+    }
 
-    allocator_type get_allocator() const noexcept;
+    allocator_type get_allocator() const noexcept {
+        return _t.get_allocator();
+    }
 
     // iterators:
-    iterator begin() noexcept;
-    const_iterator begin() const noexcept;
-    iterator end() noexcept;
-    const_iterator end() const noexcept;
+    const_iterator begin() const noexcept {
+        return _t.at(0);
+    }
+    const_iterator end() const noexcept {
+        return _t.at(size());
+    }
 
-    reverse_iterator rbegin() noexcept;
-    const_reverse_iterator rbegin() const noexcept;
-    reverse_iterator rend() noexcept;
-    const_reverse_iterator rend() const noexcept;
+    const_reverse_iterator rbegin() const noexcept {
+        return const_reverse_iterator(end());
+    }
+    const_reverse_iterator rend() const noexcept {
+        return const_reverse_iterator(begin());
+    }
 
-    const_iterator cbegin() noexcept;
-    const_iterator cend() noexcept;
-    const_reverse_iterator crbegin() const noexcept;
-    const_reverse_iterator crend() const noexcept;
+    const_iterator cbegin() const noexcept {
+        return begin();
+    }
+    const_iterator cend() const noexcept {
+        return end();
+    }
+    const_reverse_iterator crbegin() const noexcept {
+        return rbegin();
+    }
+    const_reverse_iterator crend() const noexcept {
+        return rend();
+    }
 
     // capacity:
     bool empty() const noexcept {
@@ -232,73 +158,482 @@ public:
     };
 
     size_type size() const noexcept {
-        return _root ? _root->_n : 0;
+        return _t.size();
     };
     size_type max_size() const noexcept {
         return std::numeric_limits<size_type>::max();
     }
 
     // element access:
-    T& operator[](const key_type& x);
-    T& operator[](key_type&& x);
-    T& at(const key_type& x);
-    const T& at(const key_type& x) const;
+    const T& at(const key_type& x) const {
+        size_type i = _t.find(x);
+        if (i == size())
+            throw std::out_of_range("persistent::map::at");
+        return _t.at(i)->second;
+    }
 
     // modifiers:
     template <class... Args>
-    std::pair<iterator, bool> emplace(Args&&... args);
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        const value_type x(std::forward<Args>(args)...);
+        return insert(x);
+    }
     template <class... Args>
-    iterator emplace_hint(const_iterator position, Args&&... args);
-    std::pair<iterator, bool> insert(const value_type& x);
-    template <class P>
-    std::pair<iterator, bool> insert(P&& x);
-    iterator insert(const_iterator position, const value_type& x);
-    template <class P>
-    iterator insert(const_iterator position, P&&);
+    iterator emplace_hint(const_iterator position, Args&&... args) {
+        return emplace(std::forward<Args>(args)...).first;
+    }
+    std::pair<iterator, bool> insert(const value_type& x) {
+        std::pair<size_t, bool> r = _t.insert(x, true);
+        return std::make_pair(_t.at(r.first), r.second);
+    }
+    template <class P,
+              class = typename std::enable_if<std::is_constructible<value_type, P&&>::value>::type>
+    std::pair<iterator, bool> insert(P&& x) {
+        const value_type v(std::forward<P>(x));
+        return insert(v);
+    }
+    iterator insert(const_iterator position, const value_type& x) {
+        return insert(x).first;
+    }
+    template <class P,
+              class = typename std::enable_if<std::is_constructible<value_type, P&&>::value>::type>
+    iterator insert(const_iterator position, P&& x) {
+        return insert(std::forward<P>(x)).first;
+    }
+    /**
+     * Maps k to obj. If k is already mapped to a value equal to obj, the write is elided during
+     * the descent: nothing is allocated and the map keeps its current root, so versions can still
+     * be compared by identity. Returns true if k was inserted.
+     */
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const key_type& k, M&& obj) {
+        bool inserted = false;
+        size_t rank = _t.modify(k, [&](const node_ptr& n) -> node_ptr {
+            T v(std::forward<M>(obj));
+            if (!n) {
+                inserted = true;
+                return _t.leaf(value_type(k, std::move(v)));
+            }
+            if (detail::same_value(v, n->_v.second))
+                return n;
+            return _t.replace(n, value_type(n->_v.first, std::move(v)));
+        });
+        return std::make_pair(_t.at(rank), inserted);
+    }
     template <class InputIterator>
-    void insert(InputIterator first, InputIterator last);
-    void insert(std::initializer_list<value_type>);
+    void insert(InputIterator first, InputIterator last) {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+    void insert(std::initializer_list<value_type> il) {
+        insert(il.begin(), il.end());
+    }
 
-    iterator erase(const_iterator position);
-    size_type erase(const key_type& x);
-    iterator erase(const_iterator first, const_iterator last);
-    void swap(map<Key, T, Compare, Allocator>&);
-    void clear() noexcept;
+    iterator erase(const_iterator position) {
+        _t.erase_at(position.index());
+        return _t.at(position.index());
+    }
+    size_type erase(const key_type& x) {
+        return _t.erase(x);
+    }
+    iterator erase(const_iterator first, const_iterator last) {
+        for (difference_type n = last - first; n > 0; --n)
+            _t.erase_at(first.index());
+        return _t.at(first.index());
+    }
+    /**
+     * Replaces the value mapped to x by fn(value) in a single descent. If fn returns a value equal
+     * to the existing one, nothing is allocated and the map keeps its current root. Returns false
+     * if x is not present.
+     */
+    template <class F>
+    bool update(const key_type& x, F fn) {
+        bool found = false;
+        _t.modify(x, [&](const node_ptr& n) -> node_ptr {
+            if (!n)
+                return n;
+            found = true;
+            T v = fn(n->_v.second);
+            if (detail::same_value(v, n->_v.second))
+                return n;
+            return _t.replace(n, value_type(n->_v.first, std::move(v)));
+        });
+        return found;
+    }
+    /**
+     * Maps x to fn(value) if x is present, and to make() otherwise, in a single descent. Returns
+     * true if x was inserted.
+     */
+    template <class Make, class F>
+    bool upsert(const key_type& x, Make make, F fn) {
+        bool inserted = false;
+        _t.modify(x, [&](const node_ptr& n) -> node_ptr {
+            if (!n) {
+                inserted = true;
+                return _t.leaf(value_type(x, make()));
+            }
+            T v = fn(n->_v.second);
+            if (detail::same_value(v, n->_v.second))
+                return n;
+            return _t.replace(n, value_type(n->_v.first, std::move(v)));
+        });
+        return inserted;
+    }
+    /**
+     * Removes x if pred(value) holds, in a single descent. Returns true if x was removed.
+     */
+    template <class Pred>
+    bool erase_if(const key_type& x, Pred pred) {
+        bool erased = false;
+        _t.modify(x, [&](const node_ptr& n) -> node_ptr {
+            erased = n && pred(n->_v.second);
+            return erased ? node_ptr() : n;
+        });
+        return erased;
+    }
+    /**
+     * Removes and returns the element with the smallest key, copying only the leftmost spine.
+     * The map must not be empty.
+     */
+    value_type pop_front() {
+        return _t.extract_at(0)->_v;
+    }
+    /**
+     * Removes and returns the element with the largest key, copying only the rightmost spine.
+     * The map must not be empty.
+     */
+    value_type pop_back() {
+        return _t.extract_at(size() - 1)->_v;
+    }
+    /**
+     * Replaces the contents by n elements returned by successive calls to next(), which must
+     * produce them in strictly increasing key order. The tree is built bottom-up in O(n), rather
+     * than in O(n log n) by inserting each element.
+     */
+    template <class F>
+    void assign_sorted(size_type n, F next) {
+        _t.assign(n, next);
+    }
+    void swap(map<Key, T, Compare, Allocator>& x) {
+        _t.swap(x._t);
+    }
+    void clear() noexcept {
+        _t.clear();
+    }
 
     // observers:
-    key_compare key_comp() const;
-    value_compare value_comp() const;
+    key_compare key_comp() const {
+        return _t.key_comp();
+    }
+    value_compare value_comp() const {
+        return value_compare(key_comp());
+    }
 
     // map operations:
-    iterator find(const key_type& x);
-    const_iterator find(const key_type& x) const;
-    size_type count(const key_type& x) const;
+    const_iterator find(const key_type& x) const {
+        return _t.at(_t.find(x));
+    }
+    size_type count(const key_type& x) const {
+        return _t.find(x) != size();
+    }
 
-    iterator lower_bound(const key_type& x);
-    const_iterator lower_bound(const key_type& x) const;
-    iterator upper_bound(const key_type& x);
-    const_iterator upper_bound(const key_type& x) const;
+    const_iterator lower_bound(const key_type& x) const {
+        return _t.at(_t.lower_bound(x));
+    }
+    const_iterator upper_bound(const key_type& x) const {
+        return _t.at(_t.upper_bound(x));
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const key_type& x) const {
+        return std::make_pair(lower_bound(x), upper_bound(x));
+    }
 
-    std::pair<iterator, iterator> equal_range(const key_type& x);
-    std::pair<const_iterator, const_iterator> equal_range(const key_type& x) const;
+    /**
+     * Returns a map of the k elements with the smallest keys, or of all elements if there are
+     * fewer. Takes O(log n) regardless of k and shares nodes with this map.
+     */
+    map top_k(size_type k) const {
+        map m(*this);
+        m._t.slice(0, std::min(k, size()));
+        return m;
+    }
+
+    // paging:
+    /**
+     * Calls f for each element in [first, last), in O(log n + k) for k elements.
+     */
+    template <class F>
+    void for_each(const_iterator first, const_iterator last, F f) const {
+        _t.for_each(first.index(), last.index(), f);
+    }
+    /**
+     * Calls f for up to limit elements starting at first, which may be obtained from an offset
+     * as begin() + offset, from a key with lower_bound(), or from a token with resume(). Returns
+     * an iterator past the last element visited.
+     */
+    template <class F>
+    const_iterator page(const_iterator first, size_type limit, F f) const {
+        const_iterator last = first + std::min<size_type>(limit, end() - first);
+        for_each(first, last, f);
+        return last;
+    }
+    /**
+     * Returns a token for resuming after the element preceding next, which must not be begin().
+     */
+    page_token token(const_iterator next) const {
+        page_token t = {next.index() - 1, next[-1].first};
+        return t;
+    }
+    /**
+     * Returns an iterator to the first element after the key recorded in t. The token may come
+     * from this or any other version of the map, and its key may since have been erased. The
+     * rank is trusted only if the element there is not past the key and the next one is, and
+     * the key is searched for otherwise.
+     */
+    const_iterator resume(const page_token& t) const {
+        if (t.rank < size() && !key_comp()(t.key, _t.at(t.rank)->first) &&
+            (t.rank + 1 == size() || key_comp()(t.key, _t.at(t.rank + 1)->first)))
+            return _t.at(t.rank + 1);
+        return upper_bound(t.key);
+    }
+
+    // sampling:
+    /**
+     * Returns an iterator to an element chosen uniformly at random, or end() if the map is empty.
+     * Takes a single O(log n) descent by index.
+     */
+    template <class URNG>
+    const_iterator sample(URNG& g) const {
+        if (empty())
+            return end();
+        return _t.at(std::uniform_int_distribution<size_type>(0, size() - 1)(g));
+    }
+    /**
+     * Writes iterators to min(k, size()) distinct elements chosen uniformly at random to out, in
+     * key order. Uses Floyd's algorithm to draw the ranks, so this takes O(k log n) regardless of
+     * the size of the map.
+     */
+    template <class URNG, class OutputIterator>
+    OutputIterator sample_k(size_type k, URNG& g, OutputIterator out) const {
+        size_type n = size();
+        k = std::min(k, n);
+        std::unordered_set<size_type> drawn;
+        std::vector<size_type> ranks;
+        ranks.reserve(k);
+        for (size_type j = n - k; j < n; ++j) {
+            size_type r = std::uniform_int_distribution<size_type>(0, j)(g);
+            if (!drawn.insert(r).second) {
+                r = j;
+                drawn.insert(r);
+            }
+            ranks.push_back(r);
+        }
+        std::sort(ranks.begin(), ranks.end());
+        for (size_type r : ranks)
+            *out++ = _t.at(r);
+        return out;
+    }
+
+    // version comparison:
+    /**
+     * Calls fn(x, y) in key order for each key in a or b, where x and y point to its elements in
+     * a and b, or are null if it is absent from that version. Elements in subtrees that both
+     * versions share are skipped, so comparing a map with an updated copy costs O(d log n) for
+     * d differing elements rather than O(n).
+     */
+    template <class F>
+    friend void co_iterate(const map& a, const map& b, F fn) {
+        auto skip = [](size_type, size_type) {};
+        a._t.co_iterate(b._t, fn, skip);
+    }
+    /**
+     * Like co_iterate(a, b, fn), but instead of skipping the elements of a subtree shared by a and
+     * b, calls shared(first, last) once with the iterators in a delimiting them.
+     */
+    template <class F, class G>
+    friend void co_iterate(const map& a, const map& b, F fn, G shared) {
+        auto report = [&](size_type first, size_type last) {
+            shared(a._t.at(first), a._t.at(last));
+        };
+        a._t.co_iterate(b._t, fn, report);
+    }
 
 private:
-    node_ptr _root;
+    tree _t;
+};
+
+/**
+ * Like map, but allows multiple elements with equivalent keys. Equivalent elements are kept in
+ * insertion order, and counting them takes two descents regardless of how many there are.
+ */
+template <class Key,
+          class T,
+          class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class multimap {
+    typedef std::pair<const Key, T> value;
+    typedef detail::select_first<value> key_of_value;
+    typedef detail::tree<Key,
+                         value,
+                         key_of_value,
+                         Compare,
+                         Allocator,
+                         typename detail::key_augment<Key, Compare, key_of_value>::type>
+        tree;
+
+public:
+    // types:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<const Key, T> value_type;
+    typedef Compare key_compare;
+    typedef Allocator allocator_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef typename tree::iterator iterator;
+    typedef typename tree::iterator const_iterator;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    explicit multimap(const Compare& comp = Compare(), const Allocator& a = Allocator())
+        : _t(comp, a){};
+    template <class InputIterator>
+    multimap(InputIterator first,
+             InputIterator last,
+             const Compare& comp = Compare(),
+             const Allocator& a = Allocator())
+        : _t(comp, a) {
+        insert(first, last);
+    }
+    multimap(std::initializer_list<value_type> il,
+             const Compare& comp = Compare(),
+             const Allocator& a = Allocator())
+        : _t(comp, a) {
+        insert(il.begin(), il.end());
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return _t.get_allocator();
+    }
+
+    // iterators:
+    const_iterator begin() const noexcept {
+        return _t.at(0);
+    }
+    const_iterator end() const noexcept {
+        return _t.at(size());
+    }
+    const_reverse_iterator rbegin() const noexcept {
+        return const_reverse_iterator(end());
+    }
+    const_reverse_iterator rend() const noexcept {
+        return const_reverse_iterator(begin());
+    }
+
+    // capacity:
+    bool empty() const noexcept {
+        return size() == 0;
+    };
+    size_type size() const noexcept {
+        return _t.size();
+    };
+
+    // modifiers:
+    iterator insert(const value_type& x) {
+        return _t.at(_t.insert(x, false).first);
+    }
+    template <class InputIterator>
+    void insert(InputIterator first, InputIterator last) {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+    iterator erase(const_iterator position) {
+        _t.erase_at(position.index());
+        return _t.at(position.index());
+    }
+    size_type erase(const key_type& x) {
+        size_type first = _t.lower_bound(x);
+        size_type n = _t.upper_bound(x) - first;
+        for (size_type i = 0; i < n; ++i)
+            _t.erase_at(first);
+        return n;
+    }
+    value_type pop_front() {
+        return _t.extract_at(0)->_v;
+    }
+    value_type pop_back() {
+        return _t.extract_at(size() - 1)->_v;
+    }
+    void swap(multimap& x) {
+        _t.swap(x._t);
+    }
+    void clear() noexcept {
+        _t.clear();
+    }
+
+    // observers:
+    key_compare key_comp() const {
+        return _t.key_comp();
+    }
+
+    // map operations:
+    const_iterator find(const key_type& x) const {
+        return _t.at(_t.find(x));
+    }
+    size_type count(const key_type& x) const {
+        return _t.upper_bound(x) - _t.lower_bound(x);
+    }
+    const_iterator lower_bound(const key_type& x) const {
+        return _t.at(_t.lower_bound(x));
+    }
+    const_iterator upper_bound(const key_type& x) const {
+        return _t.at(_t.upper_bound(x));
+    }
+    std::pair<const_iterator, const_iterator> equal_range(const key_type& x) const {
+        return std::make_pair(lower_bound(x), upper_bound(x));
+    }
+    multimap top_k(size_type k) const {
+        multimap m(*this);
+        m._t.slice(0, std::min(k, size()));
+        return m;
+    }
+
+private:
+    tree _t;
 };
 
 template <class Key, class T, class Compare, class Allocator>
-bool operator==(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y);
+bool operator==(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y) {
+    return x.size() == y.size() && std::equal(x.begin(), x.end(), y.begin());
+}
 template <class Key, class T, class Compare, class Allocator>
-bool operator<(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y);
+bool operator<(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y) {
+    return std::lexicographical_compare(x.begin(), x.end(), y.begin(), y.end());
+}
 template <class Key, class T, class Compare, class Allocator>
-bool operator!=(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y);
+bool operator!=(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y) {
+    return !(x == y);
+}
 template <class Key, class T, class Compare, class Allocator>
-bool operator>(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y);
+bool operator>(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y) {
+    return y < x;
+}
 template <class Key, class T, class Compare, class Allocator>
-bool operator>=(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y);
+bool operator>=(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y) {
+    return !(x < y);
+}
 template <class Key, class T, class Compare, class Allocator>
-bool operator<=(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y);
+bool operator<=(const map<Key, T, Compare, Allocator>& x, const map<Key, T, Compare, Allocator>& y) {
+    return !(y < x);
+}
 
 template <class Key, class T, class Compare, class Allocator>
-void swap(map<Key, T, Compare, Allocator>& x, map<Key, T, Compare, Allocator>& y);
-}
\ No newline at end of file
+void swap(map<Key, T, Compare, Allocator>& x, map<Key, T, Compare, Allocator>& y) {
+    x.swap(y);
+}
+}
+
+#endif
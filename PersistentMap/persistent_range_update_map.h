@@ -0,0 +1,223 @@
+//
+//  persistent_range_update_map.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_RANGE_UPDATE_MAP_H
+#define PERSISTENT_RANGE_UPDATE_MAP_H
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "persistent_tree.h"
+
+namespace persistent {
+namespace detail {
+/**
+ * Holds an operation still to be applied to every mapped value in the subtree, after any that
+ * are pending further down.
+ */
+template <class Op>
+struct lazy_update {
+    lazy_update() : _pending(false) {}
+
+    template <class Node>
+    void update(const Node&) {}
+
+    bool pending() const {
+        return _pending;
+    }
+    template <class Value>
+    Value apply(const Value& v) const {
+        return _pending ? Value(v.first, _op(v.second)) : v;
+    }
+    void defer(const Op& op) {
+        if (_pending)
+            _op.then(op);
+        else
+            _op = op;
+        _pending = true;
+    }
+    void defer(const lazy_update& x) {
+        if (x._pending)
+            defer(x._op);
+    }
+
+    Op _op;
+    bool _pending;
+};
+}
+
+/**
+ * Operation x -> a * x + b on mapped values, for use with range_update_map. Adding a delta,
+ * scaling and assigning are special cases, and any sequence of them composes to a single affine.
+ */
+template <class T>
+struct affine {
+    affine(const T& a = T(1), const T& b = T()) : a(a), b(b) {}
+
+    static affine add(const T& delta) {
+        return affine(T(1), delta);
+    }
+    static affine scale(const T& factor) {
+        return affine(factor, T());
+    }
+    static affine assign(const T& x) {
+        return affine(T(), x);
+    }
+
+    T operator()(const T& x) const {
+        return a * x + b;
+    }
+    /**
+     * Makes this the operation that applies this one and then later.
+     */
+    void then(const affine& later) {
+        b = later.a * b + later.b;
+        a = later.a * a;
+    }
+
+    T a;
+    T b;
+};
+
+/**
+ * Map supporting apply_range(first, last, op), which applies op to every value mapped to a key in
+ * [first, last) in O(log n), copying only the nodes along the two edges of the range. Whole
+ * subtrees inside the range just record op as pending; it is handed down to their children
+ * whenever an update takes them apart, and composed along the path when values are read. Op must
+ * be default constructible, map a const T& to a T, and have then(const Op& later), which turns it
+ * into the operation applying itself followed by later.
+ *
+ * As stored values may lag behind pending operations, elements are returned by value instead of
+ * through iterators.
+ */
+template <class Key,
+          class T,
+          class Op = affine<T>,
+          class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class range_update_map {
+    typedef std::pair<const Key, T> value;
+    typedef detail::lazy_update<Op> augment;
+    typedef detail::tree<Key, value, detail::select_first<value>, Compare, Allocator, augment> tree;
+    typedef typename tree::node node;
+    typedef typename tree::node_ptr node_ptr;
+
+public:
+    // types:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<const Key, T> value_type;
+    typedef Op operation_type;
+    typedef Compare key_compare;
+    typedef Allocator allocator_type;
+    typedef size_t size_type;
+
+    explicit range_update_map(const Compare& comp = Compare(), const Allocator& a = Allocator())
+        : _t(comp, a){};
+
+    allocator_type get_allocator() const noexcept {
+        return _t.get_allocator();
+    }
+
+    // capacity:
+    bool empty() const noexcept {
+        return size() == 0;
+    };
+    size_type size() const noexcept {
+        return _t.size();
+    };
+
+    // element access:
+    /**
+     * Returns the value mapped to x, with all operations applied to it so far.
+     */
+    T at(const key_type& x) const {
+        if (_t.find(x) == size())
+            throw std::out_of_range("persistent::range_update_map::at");
+        return get(_t.root(), x, _t.key_comp());
+    }
+
+    // modifiers:
+    bool insert(const value_type& x) {
+        return _t.insert(x, true).second;
+    }
+    bool insert_or_assign(const key_type& k, const T& obj) {
+        bool inserted = false;
+        _t.modify(k, [&](const node_ptr& n) {
+            inserted = !n;
+            return n ? _t.replace(n, value_type(k, obj)) : _t.leaf(value_type(k, obj));
+        });
+        return inserted;
+    }
+    size_type erase(const key_type& x) {
+        return _t.erase(x);
+    }
+    /**
+     * Applies op to the values mapped to keys in [first, last).
+     */
+    void apply_range(const key_type& first, const key_type& last, const Op& op) {
+        augment a;
+        a.defer(op);
+        _t.defer(_t.lower_bound(first), _t.lower_bound(last), a);
+    }
+    void swap(range_update_map& x) {
+        _t.swap(x._t);
+    }
+    void clear() noexcept {
+        _t.clear();
+    }
+
+    // observers:
+    key_compare key_comp() const {
+        return _t.key_comp();
+    }
+
+    // map operations:
+    size_type count(const key_type& x) const {
+        return _t.find(x) != size();
+    }
+    /**
+     * Calls f for each element in order, passing it by const reference with all operations
+     * applied, in O(n).
+     */
+    template <class F>
+    void for_each(F f) const {
+        visit(_t.root(), augment(), f);
+    }
+
+private:
+    static T get(const node* n, const key_type& x, const Compare& comp) {
+        T v = comp(x, n->_v.first) ? get(n->left(), x, comp)
+                                   : comp(n->_v.first, x) ? get(n->right(), x, comp) : n->_v.second;
+        return n->pending() ? n->_op(v) : v;
+    }
+
+    template <class F>
+    static void visit(const node* n, const augment& outer, F& f) {
+        if (!n)
+            return;
+        augment a;
+        a.defer(*n);
+        a.defer(outer);
+        visit(n->left(), a, f);
+        f(a.apply(n->_v));
+        visit(n->right(), a, f);
+    }
+
+    tree _t;
+};
+
+template <class Key, class T, class Op, class Compare, class Allocator>
+void swap(range_update_map<Key, T, Op, Compare, Allocator>& x,
+          range_update_map<Key, T, Op, Compare, Allocator>& y) {
+    x.swap(y);
+}
+}
+
+#endif
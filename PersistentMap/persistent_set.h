@@ -0,0 +1,165 @@
+//
+//  persistent_set.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_SET_H
+#define PERSISTENT_SET_H
+
+#include <algorithm>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+
+#include "persistent_tree.h"
+
+namespace persistent {
+/**
+ * Ordered set of keys sharing the tree engine of map. Nodes store only the key.
+ */
+template <class Key, class Compare = std::less<Key>, class Allocator = std::allocator<Key>>
+class set {
+    typedef detail::identity<Key> key_of_value;
+    typedef detail::tree<Key,
+                         Key,
+                         key_of_value,
+                         Compare,
+                         Allocator,
+                         typename detail::key_augment<Key, Compare, key_of_value>::type>
+        tree;
+
+public:
+    // types:
+    typedef Key key_type;
+    typedef Key value_type;
+    typedef Compare key_compare;
+    typedef Compare value_compare;
+    typedef Allocator allocator_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef typename tree::iterator iterator;
+    typedef typename tree::iterator const_iterator;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    explicit set(const Compare& comp = Compare(), const Allocator& a = Allocator())
+        : _t(comp, a){};
+    template <class InputIterator>
+    set(InputIterator first,
+        InputIterator last,
+        const Compare& comp = Compare(),
+        const Allocator& a = Allocator())
+        : _t(comp, a) {
+        insert(first, last);
+    }
+    set(std::initializer_list<value_type> il,
+        const Compare& comp = Compare(),
+        const Allocator& a = Allocator())
+        : _t(comp, a) {
+        insert(il.begin(), il.end());
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return _t.get_allocator();
+    }
+
+    // iterators:
+    const_iterator begin() const noexcept {
+        return _t.at(0);
+    }
+    const_iterator end() const noexcept {
+        return _t.at(size());
+    }
+    const_reverse_iterator rbegin() const noexcept {
+        return const_reverse_iterator(end());
+    }
+    const_reverse_iterator rend() const noexcept {
+        return const_reverse_iterator(begin());
+    }
+
+    // capacity:
+    bool empty() const noexcept {
+        return size() == 0;
+    };
+    size_type size() const noexcept {
+        return _t.size();
+    };
+    size_type max_size() const noexcept {
+        return std::numeric_limits<size_type>::max();
+    }
+
+    // modifiers:
+    std::pair<iterator, bool> insert(const value_type& x) {
+        std::pair<size_t, bool> r = _t.insert(x, true);
+        return std::make_pair(_t.at(r.first), r.second);
+    }
+    template <class InputIterator>
+    void insert(InputIterator first, InputIterator last) {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+    iterator erase(const_iterator position) {
+        _t.erase_at(position.index());
+        return _t.at(position.index());
+    }
+    size_type erase(const key_type& x) {
+        return _t.erase(x);
+    }
+    void swap(set& x) {
+        _t.swap(x._t);
+    }
+    void clear() noexcept {
+        _t.clear();
+    }
+
+    // observers:
+    key_compare key_comp() const {
+        return _t.key_comp();
+    }
+    value_compare value_comp() const {
+        return _t.key_comp();
+    }
+
+    // set operations:
+    const_iterator find(const key_type& x) const {
+        return _t.at(_t.find(x));
+    }
+    size_type count(const key_type& x) const {
+        return _t.find(x) != size();
+    }
+    const_iterator lower_bound(const key_type& x) const {
+        return _t.at(_t.lower_bound(x));
+    }
+    const_iterator upper_bound(const key_type& x) const {
+        return _t.at(_t.upper_bound(x));
+    }
+    std::pair<const_iterator, const_iterator> equal_range(const key_type& x) const {
+        return std::make_pair(lower_bound(x), upper_bound(x));
+    }
+
+private:
+    tree _t;
+};
+
+template <class Key, class Compare, class Allocator>
+bool operator==(const set<Key, Compare, Allocator>& x, const set<Key, Compare, Allocator>& y) {
+    return x.size() == y.size() && std::equal(x.begin(), x.end(), y.begin());
+}
+template <class Key, class Compare, class Allocator>
+bool operator!=(const set<Key, Compare, Allocator>& x, const set<Key, Compare, Allocator>& y) {
+    return !(x == y);
+}
+
+template <class Key, class Compare, class Allocator>
+void swap(set<Key, Compare, Allocator>& x, set<Key, Compare, Allocator>& y) {
+    x.swap(y);
+}
+}
+
+#endif
@@ -0,0 +1,82 @@
+//
+//  persistent_shared_value.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_SHARED_VALUE_H
+#define PERSISTENT_SHARED_VALUE_H
+
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <utility>
+
+namespace persistent {
+/**
+ * Immutable value kept in a separately reference counted block, for use as the mapped type of a
+ * map whose values are large. Copying a node, as path copying and rebalancing do for every node
+ * on the path of an update, then copies only this handle and the block is shared by the clones
+ * and by all versions of the map. Only assigning a new value to a key allocates a new block.
+ */
+template <class T>
+class shared_value {
+public:
+    typedef T element_type;
+
+    shared_value() : _p(std::make_shared<const T>()) {}
+    shared_value(const T& x) : _p(std::make_shared<const T>(x)) {}
+    shared_value(T&& x) : _p(std::make_shared<const T>(std::move(x))) {}
+
+    const T& get() const {
+        return *_p;
+    }
+    operator const T&() const {
+        return *_p;
+    }
+    const T& operator*() const {
+        return *_p;
+    }
+    const T* operator->() const {
+        return _p.get();
+    }
+
+    /**
+     * Returns whether x and y share a block, which is how a value left unchanged is recognized.
+     */
+    friend bool shares(const shared_value& x, const shared_value& y) {
+        return x._p == y._p;
+    }
+
+private:
+    std::shared_ptr<const T> _p;
+};
+
+template <class T>
+auto operator==(const shared_value<T>& x, const shared_value<T>& y) -> decltype(*x == *y) {
+    return shares(x, y) || *x == *y;
+}
+template <class T>
+auto operator!=(const shared_value<T>& x, const shared_value<T>& y) -> decltype(*x == *y) {
+    return !(x == y);
+}
+
+template <class T, class Enable>
+struct codec;
+
+/**
+ * Encodes a shared value as the value itself.
+ */
+template <class T>
+struct codec<shared_value<T>, void> {
+    static void write(std::ostream& os, const shared_value<T>& x) {
+        codec<T, void>::write(os, *x);
+    }
+    static shared_value<T> read(std::istream& is) {
+        return codec<T, void>::read(is);
+    }
+};
+}
+
+#endif
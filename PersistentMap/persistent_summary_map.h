@@ -0,0 +1,357 @@
+//
+//  persistent_summary_map.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_SUMMARY_MAP_H
+#define PERSISTENT_SUMMARY_MAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+#include "persistent_tree.h"
+
+namespace persistent {
+namespace detail {
+/**
+ * Keeps the summary of all mapped values in the subtree, merged in key order.
+ */
+template <class Summary>
+struct subtree_summary {
+    template <class Node>
+    void update(const Node& n) {
+        if (n._l)
+            _s = n._l->_s;
+        _s.merge(Summary(n._v.second));
+        if (n._r)
+            _s.merge(n._r->_s);
+    }
+
+    Summary _s;
+};
+}
+
+/**
+ * Map whose nodes each hold a Summary of the mapped values in their subtree, so that the values
+ * of any key range can be summarized with O(log n) merges instead of a scan. A Summary must be
+ * default constructible as the empty summary, constructible from a single mapped value, and have
+ * an associative merge(const Summary&) that appends a summary of later keys. As every node holds
+ * one, summaries should be small; the path copied by an update recomputes O(log n) of them.
+ */
+template <class Key,
+          class T,
+          class Summary,
+          class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class summary_map {
+    typedef std::pair<const Key, T> value;
+    typedef detail::tree<Key,
+                         value,
+                         detail::select_first<value>,
+                         Compare,
+                         Allocator,
+                         detail::subtree_summary<Summary>>
+        tree;
+    typedef typename tree::node node;
+
+public:
+    // types:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<const Key, T> value_type;
+    typedef Summary summary_type;
+    typedef Compare key_compare;
+    typedef Allocator allocator_type;
+    typedef typename tree::iterator iterator;
+    typedef typename tree::iterator const_iterator;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    explicit summary_map(const Compare& comp = Compare(), const Allocator& a = Allocator())
+        : _t(comp, a){};
+
+    allocator_type get_allocator() const noexcept {
+        return _t.get_allocator();
+    }
+
+    // iterators:
+    const_iterator begin() const noexcept {
+        return _t.at(0);
+    }
+    const_iterator end() const noexcept {
+        return _t.at(size());
+    }
+
+    // capacity:
+    bool empty() const noexcept {
+        return size() == 0;
+    };
+    size_type size() const noexcept {
+        return _t.size();
+    };
+
+    // element access:
+    const T& at(const key_type& x) const {
+        size_type i = _t.find(x);
+        if (i == size())
+            throw std::out_of_range("persistent::summary_map::at");
+        return _t.at(i)->second;
+    }
+
+    // modifiers:
+    std::pair<iterator, bool> insert(const value_type& x) {
+        std::pair<size_t, bool> r = _t.insert(x, true);
+        return std::make_pair(_t.at(r.first), r.second);
+    }
+    size_type erase(const key_type& x) {
+        return _t.erase(x);
+    }
+    void swap(summary_map& x) {
+        _t.swap(x._t);
+    }
+    void clear() noexcept {
+        _t.clear();
+    }
+
+    // observers:
+    key_compare key_comp() const {
+        return _t.key_comp();
+    }
+
+    // map operations:
+    const_iterator find(const key_type& x) const {
+        return _t.at(_t.find(x));
+    }
+    size_type count(const key_type& x) const {
+        return _t.find(x) != size();
+    }
+    const_iterator lower_bound(const key_type& x) const {
+        return _t.at(_t.lower_bound(x));
+    }
+    const_iterator upper_bound(const key_type& x) const {
+        return _t.at(_t.upper_bound(x));
+    }
+
+    // summaries:
+    /**
+     * Returns the summary of all mapped values.
+     */
+    Summary summarize() const {
+        return _t.root() ? _t.root()->_s : Summary();
+    }
+    /**
+     * Returns the summary of the values mapped to keys in [first, last).
+     */
+    Summary summarize(const key_type& first, const key_type& last) const {
+        Summary s;
+        summarize(_t.root(), _t.lower_bound(first), _t.lower_bound(last), s);
+        return s;
+    }
+    /**
+     * For a Summary with a weight() that adds up non-negative weights, such as weight_sum, returns
+     * an element chosen with probability proportional to its weight, or end() if all weights are
+     * zero. One O(log n) descent guided by the subtree weights.
+     */
+    template <class URNG>
+    const_iterator sample_weighted(URNG& g) const {
+        const node* n = _t.root();
+        if (!n || !(n->_s.weight() > 0))
+            return end();
+        double r = std::uniform_real_distribution<double>(0, n->_s.weight())(g);
+        size_t rank = 0;
+        size_t fallback = size();
+        for (;;) {
+            double left = n->_l ? n->_l->_s.weight() : 0;
+            if (r < left) {
+                n = n->left();
+                continue;
+            }
+            r -= left;
+            double own = Summary(n->_v.second).weight();
+            size_t i = rank + node::size(n->_l);
+            if (own > 0 && (r < own || !n->_r))
+                return _t.at(i);
+            // Rounding may leave r past the total weight; then take the last weighted element.
+            if (own > 0)
+                fallback = i;
+            if (!n->_r)
+                return _t.at(fallback);
+            r -= own;
+            rank = i + 1;
+            n = n->right();
+        }
+    }
+
+private:
+    /**
+     * Merges into s the values with index in [first, last) of the subtree at n. The range splits
+     * into at most two paths, along which whole subtrees are merged using their summaries.
+     */
+    static void summarize(const node* n, size_t first, size_t last, Summary& s) {
+        if (!n || first >= last)
+            return;
+        if (first == 0 && last >= n->_n) {
+            s.merge(n->_s);
+            return;
+        }
+        size_t left = node::size(n->_l);
+        if (first < left)
+            summarize(n->left(), first, std::min(last, left), s);
+        if (first <= left && left < last)
+            s.merge(Summary(n->_v.second));
+        if (last > left + 1)
+            summarize(n->right(), first > left ? first - left - 1 : 0, last - left - 1, s);
+    }
+
+    tree _t;
+};
+
+/**
+ * Summary adding up the mapped values, for use with summary_map as non-negative weights for
+ * sample_weighted, or simply to sum key ranges.
+ */
+template <class W = double>
+class weight_sum {
+public:
+    weight_sum() : _w() {}
+    explicit weight_sum(const W& w) : _w(w) {}
+
+    void merge(const weight_sum& x) {
+        _w += x._w;
+    }
+    W weight() const {
+        return _w;
+    }
+
+private:
+    W _w;
+};
+
+/**
+ * Mergeable summary of a distribution of doubles for use with summary_map, giving approximate
+ * quantiles. Like a t-digest, it keeps at most Centroids (mean, weight) pairs ordered by mean,
+ * allowing heavier centroids near the median than in the tails, where accuracy matters most.
+ * The minimum and maximum are kept exactly. Accuracy improves with Centroids, at the cost of
+ * 16 bytes per centroid in every node of the summary_map.
+ */
+template <size_t Centroids = 32>
+class quantile_sketch {
+public:
+    quantile_sketch() : _size(0), _count(0), _min(0), _max(0) {}
+    explicit quantile_sketch(double x) : _size(1), _count(1), _min(x), _max(x) {
+        _c[0].mean = x;
+        _c[0].weight = 1;
+    }
+
+    size_t count() const {
+        return _count;
+    }
+
+    void merge(const quantile_sketch& x) {
+        if (!x._count)
+            return;
+        if (!_count) {
+            *this = x;
+            return;
+        }
+        centroid all[2 * Centroids];
+        size_t n = std::merge(_c, _c + _size, x._c, x._c + x._size, all, by_mean) - all;
+        _count += x._count;
+        _min = std::min(_min, x._min);
+        _max = std::max(_max, x._max);
+
+        // Merge neighbors as long as the result spans at most one unit of the t-digest scale
+        // function k(q) = delta / 2pi * asin(2q - 1), which is steep in the tails. With delta set
+        // below, any two adjacent centroids span more than one unit, so at most Centroids remain.
+        const double delta = Centroids - 1;
+        size_t out = 0;
+        double seen = 0;
+        double k_left = scale(delta, 0);
+        for (size_t i = 1; i < n; ++i) {
+            double weight = all[out].weight + all[i].weight;
+            if (scale(delta, (seen + weight) / _count) - k_left <= 1) {
+                all[out].mean += (all[i].mean - all[out].mean) * all[i].weight / weight;
+                all[out].weight = weight;
+            } else {
+                seen += all[out].weight;
+                k_left = scale(delta, seen / _count);
+                all[++out] = all[i];
+            }
+        }
+        n = out + 1;
+
+        // Guard against rounding leaving one centroid too many.
+        while (n > Centroids) {
+            size_t half = 0;
+            for (size_t i = 0; i < n; i += 2, ++half) {
+                all[half] = all[i];
+                if (i + 1 < n) {
+                    double weight = all[i].weight + all[i + 1].weight;
+                    all[half].mean += (all[i + 1].mean - all[i].mean) * all[i + 1].weight / weight;
+                    all[half].weight = weight;
+                }
+            }
+            n = half;
+        }
+        std::copy(all, all + n, _c);
+        _size = n;
+    }
+
+    /**
+     * Returns an estimate of the q-quantile, for q in [0, 1], interpolating between centroids.
+     * Returns NaN for an empty sketch.
+     */
+    double quantile(double q) const {
+        if (!_count)
+            return std::numeric_limits<double>::quiet_NaN();
+        double target = q * _count;
+        double prev_pos = 0;
+        double prev_mean = _min;
+        double seen = 0;
+        for (size_t i = 0; i < _size; ++i) {
+            double pos = seen + _c[i].weight / 2;
+            if (target < pos) {
+                double f = pos > prev_pos ? (target - prev_pos) / (pos - prev_pos) : 0;
+                return prev_mean + f * (_c[i].mean - prev_mean);
+            }
+            prev_pos = pos;
+            prev_mean = _c[i].mean;
+            seen += _c[i].weight;
+        }
+        double f = _count > prev_pos ? (target - prev_pos) / (_count - prev_pos) : 1;
+        return prev_mean + f * (_max - prev_mean);
+    }
+
+private:
+    struct centroid {
+        double mean;
+        double weight;
+    };
+
+    static bool by_mean(const centroid& x, const centroid& y) {
+        return x.mean < y.mean;
+    }
+
+    static double scale(double delta, double q) {
+        const double pi = 3.14159265358979323846;
+        return delta / (2 * pi) * std::asin(2 * std::min(q, 1.0) - 1);
+    }
+
+    centroid _c[Centroids];
+    size_t _size;
+    size_t _count;
+    double _min;
+    double _max;
+};
+}
+
+#endif
@@ -0,0 +1,968 @@
+//
+//  persistent_tree.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_TREE_H
+#define PERSISTENT_TREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace persistent {
+/**
+ * Maps keys to a 64-bit normalized prefix whose unsigned order agrees with Compare: equivalent
+ * keys have equal prefixes, and a key less than another never has a greater prefix. Specialize
+ * this with a static prefix(const Key&) for keys that are expensive to compare, such as strings
+ * or composite keys encoded as bytes. The ordered containers then store the prefix of its key in
+ * each node, and searches compare prefixes, only calling Compare when they are equal.
+ */
+template <class Key, class Compare>
+struct normalized_key {};
+
+/**
+ * The first eight bytes of a string, most significant first, padded with zero bytes. This agrees
+ * with std::less, which compares the characters of strings as unsigned bytes.
+ */
+template <>
+struct normalized_key<std::string, std::less<std::string>> {
+    static std::uint64_t prefix(const std::string& x) {
+        std::uint64_t p = 0;
+        for (size_t i = 0; i < 8; ++i)
+            p = p << 8 | (i < x.size() ? static_cast<unsigned char>(x[i]) : 0);
+        return p;
+    }
+};
+
+namespace detail {
+template <class Value>
+struct identity {
+    const Value& operator()(const Value& v) const {
+        return v;
+    }
+};
+
+template <class Pair>
+struct select_first {
+    const typename Pair::first_type& operator()(const Pair& v) const {
+        return v.first;
+    }
+};
+
+template <class T>
+class is_equality_comparable {
+    template <class U>
+    static auto test(int)
+        -> decltype(std::declval<const U&>() == std::declval<const U&>(), std::true_type());
+    template <class>
+    static std::false_type test(...);
+
+public:
+    static const bool value = decltype(test<T>(0))::value;
+};
+
+/**
+ * Returns true if x and y are known to be equal. Without an operator== for T, writes cannot be
+ * recognized as no-ops, so they are never considered equal.
+ */
+template <class T>
+typename std::enable_if<is_equality_comparable<T>::value, bool>::type same_value(const T& x,
+                                                                                 const T& y) {
+    return x == y;
+}
+template <class T>
+typename std::enable_if<!is_equality_comparable<T>::value, bool>::type same_value(const T&,
+                                                                                  const T&) {
+    return false;
+}
+
+/**
+ * Nodes derive from an augmentation, whose update() is called whenever a node is created, after
+ * its children and value are set. This is the default, which adds nothing to the node.
+ */
+struct no_augment {
+    template <class Node>
+    void update(const Node&) {}
+};
+
+/**
+ * Augmentation storing the normalized prefix of the key of each node, for the containers whose
+ * keys have a normalized_key. An augmentation with a static prefix(x) for keys x and a _prefix
+ * member is used by the tree to compare prefixes before keys.
+ */
+template <class Key, class Compare, class KeyOfValue>
+struct key_prefix {
+    template <class Node>
+    void update(const Node& n) {
+        _prefix = prefix(KeyOfValue()(n._v));
+    }
+    static std::uint64_t prefix(const Key& x) {
+        return normalized_key<Key, Compare>::prefix(x);
+    }
+
+    std::uint64_t _prefix;
+};
+
+template <class Augment, class Key>
+class is_prefixed {
+    template <class U>
+    static auto test(int) -> decltype(U::prefix(std::declval<const Key&>()),
+                                      std::declval<const U&>()._prefix,
+                                      std::true_type());
+    template <class>
+    static std::false_type test(...);
+
+public:
+    static const bool value = decltype(test<Augment>(0))::value;
+};
+
+template <class Key, class Compare>
+class has_normalized_key {
+    template <class U>
+    static auto test(int) -> decltype(U::prefix(std::declval<const Key&>()), std::true_type());
+    template <class>
+    static std::false_type test(...);
+
+public:
+    static const bool value = decltype(test<normalized_key<Key, Compare>>(0))::value;
+};
+
+/**
+ * The augmentation for containers ordered by Compare alone: key_prefix if the keys have a
+ * normalized_key, and no_augment otherwise.
+ */
+template <class Key, class Compare, class KeyOfValue>
+struct key_augment {
+    typedef typename std::conditional<
+        has_normalized_key<Key, Compare>::value,
+        key_prefix<Key, Compare, KeyOfValue>,
+        no_augment>::type type;
+};
+
+/**
+ * An augmentation may instead hold work pending for its whole subtree, such as an operation yet
+ * to be applied to every value. Such lazy augmentations define pending(), apply(v), which does
+ * the pending work on a single value, and defer(a), which adds the work pending in a after their
+ * own. Before taking a node apart, the tree hands its pending work down to its children, so that
+ * rebalancing never moves values out from under work that applies to them.
+ */
+template <class Augment>
+class is_lazy {
+    template <class U>
+    static auto test(int) -> decltype(std::declval<const U&>().pending(), std::true_type());
+    template <class>
+    static std::false_type test(...);
+
+public:
+    static const bool value = decltype(test<Augment>(0))::value;
+};
+
+/**
+ * Weight-balanced binary tree shared by the ordered persistent containers. Every node records the
+ * size of its subtree, which both drives rebalancing and gives O(log n) access by index. Nodes are
+ * immutable once linked into a tree: updates copy the path from the root to the changed node and
+ * share all other nodes with the previous version.
+ */
+template <class Key,
+          class Value,
+          class KeyOfValue,
+          class Compare,
+          class Allocator,
+          class Augment = no_augment>
+class tree {
+public:
+    struct node;
+    typedef std::shared_ptr<node> node_ptr;
+    struct node : Augment {
+        node(const node_ptr& l, const Value& v, const node_ptr& r)
+            : _n(size(l) + 1 + size(r)), _l(l), _r(r), _v(v) {
+            this->update(*this);
+        }
+        node* left() const {
+            return _l.get();
+        }
+        node* right() const {
+            return _r.get();
+        }
+        static size_t size(const node_ptr& n) {
+            return n ? n->_n : 0;
+        }
+        /**
+         * Given a tree rooted at this, return a pointer to its i-th node (zero-based).
+         */
+        const node* operator+(size_t rhs) const {
+            const node* current = this;
+            for (;;) {
+                size_t left = size(current->_l);
+                if (rhs == left)
+                    return current;
+                if (rhs < left) {
+                    current = current->left();
+                } else {
+                    rhs -= left + 1;
+                    current = current->right();
+                }
+            }
+        }
+
+        /**
+         * Descending the tree only touches the size, the children and the key, so those come
+         * first. For maps, the mapped value sits at the tail of _v, where only the final node of a
+         * search needs to load it.
+         */
+        size_t _n;
+        node_ptr _l;
+        node_ptr _r;
+        Value _v;
+    };
+
+    /**
+     * Iterators are a (root, index) pair: they stay valid for as long as the version of the tree
+     * they were obtained from, and support random access in O(log n). Nodes may be shared with
+     * other versions, so elements are only accessible through const references.
+     */
+    class iterator : public std::iterator<std::random_access_iterator_tag,
+                                          Value,
+                                          std::ptrdiff_t,
+                                          const Value*,
+                                          const Value&> {
+    public:
+        iterator() : _index(0), _root(nullptr) {}
+        iterator(const node* n, size_t index) : _index(index), _root(n) {}
+
+        iterator& operator++() {
+            ++_index;
+            return *this;
+        }
+        iterator& operator--() {
+            --_index;
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator tmp(*this);
+            operator++();
+            return tmp;
+        }
+        iterator operator--(int) {
+            iterator tmp(*this);
+            operator--();
+            return tmp;
+        }
+        iterator& operator+=(std::ptrdiff_t n) {
+            _index += n;
+            return *this;
+        }
+        iterator& operator-=(std::ptrdiff_t n) {
+            _index -= n;
+            return *this;
+        }
+        iterator operator+(std::ptrdiff_t n) const {
+            return iterator(_root, _index + n);
+        }
+        iterator operator-(std::ptrdiff_t n) const {
+            return iterator(_root, _index - n);
+        }
+        std::ptrdiff_t operator-(const iterator& rhs) const {
+            return std::ptrdiff_t(_index - rhs._index);
+        }
+        bool operator==(const iterator& rhs) const {
+            return _index == rhs._index;
+        }
+        bool operator!=(const iterator& rhs) const {
+            return _index != rhs._index;
+        }
+        bool operator<(const iterator& rhs) const {
+            return _index < rhs._index;
+        }
+        bool operator>(const iterator& rhs) const {
+            return _index > rhs._index;
+        }
+        bool operator<=(const iterator& rhs) const {
+            return _index <= rhs._index;
+        }
+        bool operator>=(const iterator& rhs) const {
+            return _index >= rhs._index;
+        }
+
+        const Value& operator*() const {
+            return (*_root + _index)->_v;
+        }
+
+        const Value* operator->() const {
+            return &(*_root + _index)->_v;
+        }
+
+        const Value& operator[](std::ptrdiff_t n) const {
+            return (*_root + (_index + n))->_v;
+        }
+
+        /**
+         * Returns the zero-based rank of the element referenced by this iterator.
+         */
+        size_t index() const {
+            return _index;
+        }
+
+    private:
+        size_t _index;
+        const node* _root;
+    };
+
+    tree(const Compare& comp, const Allocator& a) : _comp(comp), _alloc(a) {}
+
+    const node* root() const {
+        return _root.get();
+    }
+
+    size_t size() const {
+        return node::size(_root);
+    }
+
+    Compare key_comp() const {
+        return _comp;
+    }
+
+    Allocator get_allocator() const {
+        return _alloc;
+    }
+
+    iterator at(size_t index) const {
+        return iterator(_root.get(), index);
+    }
+
+    /**
+     * Calls f for the elements with index in [first, last), in order. Unlike dereferencing an
+     * iterator for each of them, this takes O(log n + k) for k elements.
+     */
+    template <class F>
+    void for_each(size_t first, size_t last, F& f) const {
+        for_each(_root.get(), first, last, f);
+    }
+
+    /**
+     * Walks the elements of this tree and y together in key order, for trees with unique keys.
+     * For each key in either tree, calls f(vx, vy) with pointers to its elements in this tree and
+     * in y, the one absent being null. Subtrees that both trees share are not descended into:
+     * instead g(first, last) receives the indices of their elements in this tree. Takes
+     * O(d log n) for d differing elements, as each side only opens subtrees that may differ.
+     */
+    template <class F, class G>
+    void co_iterate(const tree& y, F& f, G& g) const {
+        cursor a(_root.get());
+        cursor b(y._root.get());
+        while (!a.empty() && !b.empty()) {
+            const node* x = a.top();
+            const node* z = b.top();
+            if (a.whole() && b.whole() && x == z) {
+                g(a.index(), a.index() + x->_n);
+                a.pop();
+                b.pop();
+            } else if (a.whole() && (!b.whole() || x->_n >= z->_n)) {
+                a.open();
+            } else if (b.whole()) {
+                b.open();
+            } else if (_comp(key(x->_v), key(z->_v))) {
+                f(&x->_v, static_cast<const Value*>(nullptr));
+                a.pop();
+            } else if (_comp(key(z->_v), key(x->_v))) {
+                f(static_cast<const Value*>(nullptr), &z->_v);
+                b.pop();
+            } else {
+                f(&x->_v, &z->_v);
+                a.pop();
+                b.pop();
+            }
+        }
+        for (; !a.empty(); a.pop()) {
+            while (a.whole())
+                a.open();
+            f(&a.top()->_v, static_cast<const Value*>(nullptr));
+        }
+        for (; !b.empty(); b.pop()) {
+            while (b.whole())
+                b.open();
+            f(static_cast<const Value*>(nullptr), &b.top()->_v);
+        }
+    }
+
+    /**
+     * Returns the index of the first element not less than x.
+     */
+    size_t lower_bound(const Key& x) const {
+        size_t rank = 0;
+        std::uint64_t px = prefix(x);
+        for (const node* n = _root.get(); n;) {
+            if (key_less(n, x, px)) {
+                rank += node::size(n->_l) + 1;
+                n = n->right();
+            } else {
+                n = n->left();
+            }
+        }
+        return rank;
+    }
+
+    /**
+     * Returns the index of the first element greater than x.
+     */
+    size_t upper_bound(const Key& x) const {
+        size_t rank = 0;
+        std::uint64_t px = prefix(x);
+        for (const node* n = _root.get(); n;) {
+            if (!key_greater(n, x, px)) {
+                rank += node::size(n->_l) + 1;
+                n = n->right();
+            } else {
+                n = n->left();
+            }
+        }
+        return rank;
+    }
+
+    /**
+     * Returns the index of the first element equivalent to x, or size() if there is none.
+     */
+    size_t find(const Key& x) const {
+        size_t rank = 0;
+        size_t found = size();
+        std::uint64_t px = prefix(x);
+        for (const node* n = _root.get(); n;) {
+            if (key_less(n, x, px)) {
+                rank += node::size(n->_l) + 1;
+                n = n->right();
+            } else {
+                if (!key_greater(n, x, px))
+                    found = rank + node::size(n->_l);
+                n = n->left();
+            }
+        }
+        return found;
+    }
+
+    /**
+     * Inserts v, after any equivalent elements if unique is false, or not at all if unique is true
+     * and an equivalent element exists. Returns the index of v or of the equivalent element, and
+     * whether v was inserted.
+     */
+    std::pair<size_t, bool> insert(const Value& v, bool unique) {
+        size_t rank = 0;
+        bool inserted = false;
+        _root = insert(_root, v, prefix(key(v)), unique, rank, inserted);
+        return std::make_pair(rank, inserted);
+    }
+
+    /**
+     * Removes an element equivalent to x. Returns false if there was no such element.
+     */
+    bool erase(const Key& x) {
+        bool erased = false;
+        _root = erase(_root, x, prefix(x), erased);
+        return erased;
+    }
+
+    /**
+     * Descends once to the element equivalent to x and replaces its node n, or a null pointer if
+     * there is no such element, by f(n). To leave the tree unchanged f returns n, to remove the
+     * element it returns a null pointer, and otherwise it returns a node made by leaf() or
+     * replace(). Only a changed tree is copied, and only along the path to x. Returns the number
+     * of elements less than x.
+     */
+    template <class F>
+    size_t modify(const Key& x, F f) {
+        size_t rank = 0;
+        _root = modify(_root, x, prefix(x), f, rank);
+        return rank;
+    }
+
+    node_ptr leaf(const Value& v) const {
+        return make_node(node_ptr(), v, node_ptr());
+    }
+
+    node_ptr replace(const node_ptr& n, const Value& v) const {
+        return make_node(n->_l, v, n->_r);
+    }
+
+    /**
+     * For lazy augmentations, adds the work pending in a to that of the elements with index in
+     * [first, last). Whole subtrees in the range receive it without being visited, so only
+     * O(log n) nodes are copied.
+     */
+    void defer(size_t first, size_t last, const Augment& a) {
+        _root = defer(_root, first, last, a);
+    }
+
+    void erase_at(size_t index) {
+        node_ptr removed;
+        _root = erase_at(_root, index, removed);
+    }
+
+    /**
+     * Removes the element at index in a single descent, returning the node that held it.
+     */
+    node_ptr extract_at(size_t index) {
+        node_ptr removed;
+        _root = erase_at(_root, index, removed);
+        return removed;
+    }
+
+    /**
+     * The following operations ignore keys and address elements purely by index, for containers
+     * whose order is given by position rather than by Compare.
+     */
+    void insert_at(size_t index, const Value& v) {
+        _root = insert_at(_root, index, v);
+    }
+
+    void assign_at(size_t index, const Value& v) {
+        _root = assign_at(_root, index, v);
+    }
+
+    /**
+     * Appends all elements of x, sharing its nodes, in O(log n).
+     */
+    void append(const tree& x) {
+        _root = merge(_root, x._root);
+    }
+
+    /**
+     * Keeps only the elements with index in [first, last), in O(log n).
+     */
+    void slice(size_t first, size_t last) {
+        node_ptr head, tail, rest;
+        split(_root, last, head, rest);
+        split(head, first, rest, tail);
+        _root = tail;
+    }
+
+    /**
+     * Replaces all elements by n elements obtained in order from next(), building a perfectly
+     * balanced tree bottom-up in O(n) without comparing any keys.
+     */
+    template <class F>
+    void assign(size_t n, F& next) {
+        _root = build(n, next);
+    }
+
+    void clear() {
+        _root.reset();
+    }
+
+    void swap(tree& x) {
+        using std::swap;
+        swap(_root, x._root);
+        swap(_comp, x._comp);
+        swap(_alloc, x._alloc);
+    }
+
+private:
+    /**
+     * The elements of a tree not yet visited by co_iterate, in order, as a stack of whole subtrees
+     * and single elements, with the index of the first of them.
+     */
+    class cursor {
+    public:
+        explicit cursor(const node* n) : _index(0) {
+            if (n)
+                _stack.push_back(std::make_pair(n, true));
+        }
+        bool empty() const {
+            return _stack.empty();
+        }
+        const node* top() const {
+            return _stack.back().first;
+        }
+        /**
+         * Returns true if the next item is all of the subtree at top(), or false if it is just the
+         * element at top().
+         */
+        bool whole() const {
+            return _stack.back().second;
+        }
+        size_t index() const {
+            return _index;
+        }
+        void pop() {
+            _index += whole() ? top()->_n : 1;
+            _stack.pop_back();
+        }
+        /**
+         * Replaces the subtree at the top by its left subtree, root element and right subtree.
+         */
+        void open() {
+            const node* n = top();
+            _stack.pop_back();
+            if (n->_r)
+                _stack.push_back(std::make_pair(n->right(), true));
+            _stack.push_back(std::make_pair(n, false));
+            if (n->_l)
+                _stack.push_back(std::make_pair(n->left(), true));
+        }
+
+    private:
+        std::vector<std::pair<const node*, bool>> _stack;
+        size_t _index;
+    };
+
+    // Balance parameters (delta, gamma) = (3, 2), which are valid for both insertion and deletion.
+    static const size_t delta = 3;
+    static const size_t gamma = 2;
+
+    static const Key& key(const Value& v) {
+        return KeyOfValue()(v);
+    }
+
+    /**
+     * Returns true if a tree of size b is too heavy to be the sibling of one of size a.
+     */
+    static bool heavy(size_t a, size_t b) {
+        return delta * (a + 1) < b + 1;
+    }
+
+    /**
+     * Returns true if a single rotation suffices when the inner grandchild has size a and the
+     * outer one size b.
+     */
+    static bool single(size_t a, size_t b) {
+        return a + 1 < gamma * (b + 1);
+    }
+
+    /**
+     * All nodes are allocated through here, together with their reference count, so that a
+     * user-supplied Allocator (for example an arena backed by huge pages) controls node storage.
+     */
+    node_ptr make_node(const node_ptr& l, const Value& v, const node_ptr& r) const {
+        return std::allocate_shared<node>(_alloc, l, v, r);
+    }
+
+    /**
+     * Returns a node for l, v, r where l and r were balanced before one of them gained or lost
+     * a single element.
+     */
+    node_ptr balance(const node_ptr& l, const Value& v, const node_ptr& r) const {
+        size_t ln = node::size(l);
+        size_t rn = node::size(r);
+        if (heavy(ln, rn)) {
+            node_ptr tmp, tmp2;
+            const node_ptr& ro = open(r, tmp);
+            if (single(node::size(ro->_l), node::size(ro->_r)))
+                return make_node(make_node(l, v, ro->_l), ro->_v, ro->_r);
+            const node_ptr& rl = open(ro->_l, tmp2);
+            return make_node(make_node(l, v, rl->_l), rl->_v, make_node(rl->_r, ro->_v, ro->_r));
+        }
+        if (heavy(rn, ln)) {
+            node_ptr tmp, tmp2;
+            const node_ptr& lo = open(l, tmp);
+            if (single(node::size(lo->_r), node::size(lo->_l)))
+                return make_node(lo->_l, lo->_v, make_node(lo->_r, v, r));
+            const node_ptr& lr = open(lo->_r, tmp2);
+            return make_node(make_node(lo->_l, lo->_v, lr->_l), lr->_v, make_node(lr->_r, v, r));
+        }
+        return make_node(l, v, r);
+    }
+
+    typedef std::integral_constant<bool, is_prefixed<Augment, Key>::value> prefixed;
+
+    /**
+     * Returns the normalized prefix of x if nodes store one, and zero otherwise.
+     */
+    static std::uint64_t prefix(const Key& x) {
+        return prefix(x, prefixed());
+    }
+    static std::uint64_t prefix(const Key&, std::false_type) {
+        return 0;
+    }
+    static std::uint64_t prefix(const Key& x, std::true_type) {
+        return Augment::prefix(x);
+    }
+
+    /**
+     * Returns whether the key of n is less than x, whose prefix is px. Where nodes store
+     * prefixes, differing ones decide without calling the comparator.
+     */
+    bool key_less(const node* n, const Key& x, std::uint64_t px) const {
+        return key_less(n, x, px, prefixed());
+    }
+    bool key_less(const node* n, const Key& x, std::uint64_t, std::false_type) const {
+        return _comp(key(n->_v), x);
+    }
+    bool key_less(const node* n, const Key& x, std::uint64_t px, std::true_type) const {
+        return n->_prefix != px ? n->_prefix < px : _comp(key(n->_v), x);
+    }
+
+    /**
+     * Returns whether x, whose prefix is px, is less than the key of n.
+     */
+    bool key_greater(const node* n, const Key& x, std::uint64_t px) const {
+        return key_greater(n, x, px, prefixed());
+    }
+    bool key_greater(const node* n, const Key& x, std::uint64_t, std::false_type) const {
+        return _comp(x, key(n->_v));
+    }
+    bool key_greater(const node* n, const Key& x, std::uint64_t px, std::true_type) const {
+        return n->_prefix != px ? px < n->_prefix : _comp(x, key(n->_v));
+    }
+
+    /**
+     * Returns n, or if it has pending work, an equivalent node that has handed that work down to
+     * its children, using tmp to hold it. Trees without a lazy augmentation just return n.
+     */
+    const node_ptr& open(const node_ptr& n, node_ptr& tmp) const {
+        return open(n, tmp, std::integral_constant<bool, is_lazy<Augment>::value>());
+    }
+    const node_ptr& open(const node_ptr& n, node_ptr&, std::false_type) const {
+        return n;
+    }
+    const node_ptr& open(const node_ptr& n, node_ptr& tmp, std::true_type) const {
+        if (!n || !n->pending())
+            return n;
+        tmp = make_node(defer(n->_l, *n), n->apply(n->_v), defer(n->_r, *n));
+        return tmp;
+    }
+
+    /**
+     * Returns a copy of n with the work pending in a added to its own.
+     */
+    node_ptr defer(const node_ptr& n, const Augment& a) const {
+        if (!n)
+            return n;
+        node_ptr m = make_node(n->_l, n->_v, n->_r);
+        m->defer(*n);
+        m->defer(a);
+        return m;
+    }
+
+    node_ptr defer(const node_ptr& n, size_t first, size_t last, const Augment& a) const {
+        if (!n || first >= last)
+            return n;
+        if (first == 0 && last >= n->_n)
+            return defer(n, a);
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        size_t left = node::size(o->_l);
+        node_ptr l = defer(o->_l, first, std::min(last, left), a);
+        node_ptr r =
+            defer(o->_r, first > left ? first - left - 1 : 0, last > left ? last - left - 1 : 0, a);
+        return make_node(l, first <= left && left < last ? a.apply(o->_v) : o->_v, r);
+    }
+
+    node_ptr insert(const node_ptr& n,
+                    const Value& v,
+                    std::uint64_t pv,
+                    bool unique,
+                    size_t& rank,
+                    bool& inserted) const {
+        if (!n) {
+            inserted = true;
+            return make_node(node_ptr(), v, node_ptr());
+        }
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        if (key_greater(o.get(), key(v), pv)) {
+            node_ptr l = insert(o->_l, v, pv, unique, rank, inserted);
+            return l == o->_l ? n : balance(l, o->_v, o->_r);
+        }
+        if (unique && !key_less(o.get(), key(v), pv)) {
+            rank += node::size(o->_l);
+            return n;
+        }
+        rank += node::size(o->_l) + 1;
+        node_ptr r = insert(o->_r, v, pv, unique, rank, inserted);
+        return r == o->_r ? n : balance(o->_l, o->_v, r);
+    }
+
+    template <class F>
+    node_ptr modify(const node_ptr& n, const Key& x, std::uint64_t px, F& f, size_t& rank) const {
+        if (!n)
+            return f(n);
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        if (key_greater(o.get(), x, px)) {
+            node_ptr l = modify(o->_l, x, px, f, rank);
+            return l == o->_l ? n : balance(l, o->_v, o->_r);
+        }
+        if (key_less(o.get(), x, px)) {
+            rank += node::size(o->_l) + 1;
+            node_ptr r = modify(o->_r, x, px, f, rank);
+            return r == o->_r ? n : balance(o->_l, o->_v, r);
+        }
+        rank += node::size(o->_l);
+        node_ptr m = f(o);
+        if (m == o)
+            return n;
+        return m ? m : glue(o->_l, o->_r);
+    }
+
+    node_ptr erase(const node_ptr& n, const Key& x, std::uint64_t px, bool& erased) const {
+        if (!n)
+            return n;
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        if (key_greater(o.get(), x, px)) {
+            node_ptr l = erase(o->_l, x, px, erased);
+            return l == o->_l ? n : balance(l, o->_v, o->_r);
+        }
+        if (key_less(o.get(), x, px)) {
+            node_ptr r = erase(o->_r, x, px, erased);
+            return r == o->_r ? n : balance(o->_l, o->_v, r);
+        }
+        erased = true;
+        return glue(o->_l, o->_r);
+    }
+
+    node_ptr erase_at(const node_ptr& n, size_t index, node_ptr& removed) const {
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        size_t left = node::size(o->_l);
+        if (index < left)
+            return balance(erase_at(o->_l, index, removed), o->_v, o->_r);
+        if (index > left)
+            return balance(o->_l, o->_v, erase_at(o->_r, index - left - 1, removed));
+        removed = o;
+        return glue(o->_l, o->_r);
+    }
+
+    template <class F>
+    static void for_each(const node* n, size_t first, size_t last, F& f) {
+        while (n && first < last) {
+            size_t left = node::size(n->_l);
+            if (first < left)
+                for_each(n->left(), first, std::min(last, left), f);
+            if (last <= left)
+                return;
+            if (first <= left)
+                f(n->_v);
+            first = first <= left ? 0 : first - left - 1;
+            last -= left + 1;
+            n = n->right();
+        }
+    }
+
+    node_ptr insert_at(const node_ptr& n, size_t index, const Value& v) const {
+        if (!n)
+            return make_node(node_ptr(), v, node_ptr());
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        size_t left = node::size(o->_l);
+        if (index <= left)
+            return balance(insert_at(o->_l, index, v), o->_v, o->_r);
+        return balance(o->_l, o->_v, insert_at(o->_r, index - left - 1, v));
+    }
+
+    node_ptr assign_at(const node_ptr& n, size_t index, const Value& v) const {
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        size_t left = node::size(o->_l);
+        if (index < left)
+            return make_node(assign_at(o->_l, index, v), o->_v, o->_r);
+        if (index > left)
+            return make_node(o->_l, o->_v, assign_at(o->_r, index - left - 1, v));
+        return make_node(o->_l, v, o->_r);
+    }
+
+    template <class F>
+    node_ptr build(size_t n, F& next) const {
+        if (!n)
+            return node_ptr();
+        node_ptr l = build(n / 2, next);
+        Value v = next();
+        return make_node(l, v, build(n - 1 - n / 2, next));
+    }
+
+    /**
+     * Returns a tree holding l, then v, then r, for balanced trees l and r of any size.
+     */
+    node_ptr link(const node_ptr& l, const Value& v, const node_ptr& r) const {
+        if (!l)
+            return insert_at(r, 0, v);
+        if (!r)
+            return insert_at(l, l->_n, v);
+        node_ptr tmp;
+        if (heavy(l->_n, r->_n)) {
+            const node_ptr& ro = open(r, tmp);
+            return balance(link(l, v, ro->_l), ro->_v, ro->_r);
+        }
+        if (heavy(r->_n, l->_n)) {
+            const node_ptr& lo = open(l, tmp);
+            return balance(lo->_l, lo->_v, link(lo->_r, v, r));
+        }
+        return make_node(l, v, r);
+    }
+
+    /**
+     * Returns a tree holding l followed by r, for balanced trees l and r of any size.
+     */
+    node_ptr merge(const node_ptr& l, const node_ptr& r) const {
+        if (!l)
+            return r;
+        if (!r)
+            return l;
+        node_ptr tmp;
+        if (heavy(l->_n, r->_n)) {
+            const node_ptr& ro = open(r, tmp);
+            return balance(merge(l, ro->_l), ro->_v, ro->_r);
+        }
+        if (heavy(r->_n, l->_n)) {
+            const node_ptr& lo = open(l, tmp);
+            return balance(lo->_l, lo->_v, merge(lo->_r, r));
+        }
+        return glue(l, r);
+    }
+
+    /**
+     * Sets l to the first index elements of n, and r to the remaining ones.
+     */
+    void split(const node_ptr& n, size_t index, node_ptr& l, node_ptr& r) const {
+        if (!n) {
+            l = r = node_ptr();
+            return;
+        }
+        node_ptr tmp;
+        const node_ptr& o = open(n, tmp);
+        size_t left = node::size(o->_l);
+        if (index <= left) {
+            node_ptr rl;
+            split(o->_l, index, l, rl);
+            r = link(rl, o->_v, o->_r);
+        } else {
+            node_ptr lr;
+            split(o->_r, index - left - 1, lr, r);
+            l = link(o->_l, o->_v, lr);
+        }
+    }
+
+    /**
+     * Joins two balanced trees whose sizes were balanced with respect to each other, replacing
+     * their former parent.
+     */
+    node_ptr glue(const node_ptr& l, const node_ptr& r) const {
+        if (!l)
+            return r;
+        if (!r)
+            return l;
+        node_ptr moved;
+        if (l->_n > r->_n) {
+            node_ptr rest = erase_at(l, l->_n - 1, moved);
+            return balance(rest, moved->_v, r);
+        }
+        node_ptr rest = erase_at(r, 0, moved);
+        return balance(l, moved->_v, rest);
+    }
+
+    node_ptr _root;
+    Compare _comp;
+    Allocator _alloc;
+};
+}
+}
+
+#endif
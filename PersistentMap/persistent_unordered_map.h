@@ -0,0 +1,666 @@
+//
+//  persistent_unordered_map.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_UNORDERED_MAP_H
+#define PERSISTENT_UNORDERED_MAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "persistent_tree.h"
+
+namespace persistent {
+/**
+ * Hash array mapped trie: each level consumes bits_per_level bits of the hash, and a node only
+ * stores the entries present at that level, indexed by the popcount of its bitmaps. Values stored
+ * directly in a node are tracked by _datamap, subtrees by _nodemap. Once all hash bits are used,
+ * a node degenerates into a list of colliding values. Nodes are never modified once shared,
+ * updates copy the path from the root to the changed node.
+ *
+ * As in CHAMP, a node is a single allocation holding a header, its values and then its children,
+ * so copying a node on the path of an update allocates once. Nodes count their references
+ * themselves, as the children are plain pointers into that allocation.
+ *
+ * The interface follows map where the lack of order allows: iterators are forward iterators
+ * visiting the elements in no particular order, and there are no ordered operations or views.
+ */
+template <class Key,
+          class T,
+          class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class unordered_map {
+    typedef std::pair<const Key, T> value;
+
+    static const unsigned bits_per_level = 5;
+    static const unsigned hash_bits = std::numeric_limits<size_t>::digits;
+    static const unsigned max_depth = hash_bits / bits_per_level + 2;
+
+    struct node {
+        node(uint32_t datamap, uint32_t nodemap, uint32_t values, uint32_t children)
+            : _refs(1),
+              _datamap(datamap),
+              _nodemap(nodemap),
+              _values(values),
+              _children(children) {}
+
+        static unsigned index(uint32_t map, uint32_t bit) {
+            return __builtin_popcount(map & (bit - 1));
+        }
+
+        static size_t values_offset() {
+            return (sizeof(node) + alignof(value) - 1) / alignof(value) * alignof(value);
+        }
+        static size_t children_offset(uint32_t values) {
+            size_t end = values_offset() + values * sizeof(value);
+            return (end + alignof(node*) - 1) / alignof(node*) * alignof(node*);
+        }
+        static size_t bytes(uint32_t values, uint32_t children) {
+            return children_offset(values) + children * sizeof(node*);
+        }
+
+        value* v() {
+            return reinterpret_cast<value*>(reinterpret_cast<char*>(this) + values_offset());
+        }
+        const value* v() const {
+            return const_cast<node*>(this)->v();
+        }
+        node** c() {
+            return reinterpret_cast<node**>(reinterpret_cast<char*>(this) +
+                                            children_offset(_values));
+        }
+        node* const* c() const {
+            return const_cast<node*>(this)->c();
+        }
+
+        std::atomic<size_t> _refs;
+        uint32_t _datamap;
+        uint32_t _nodemap;
+        uint32_t _values;
+        uint32_t _children;
+    };
+
+    struct alignas(std::max_align_t) unit {
+        char bytes[alignof(std::max_align_t)];
+    };
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<unit> unit_allocator;
+
+    static_assert(alignof(value) <= alignof(unit), "over-aligned values are not supported");
+
+public:
+    // types:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<const Key, T> value_type;
+    typedef Hash hasher;
+    typedef KeyEqual key_equal;
+    typedef Allocator allocator_type;
+    typedef size_t size_type;
+
+    /**
+     * Forward iterator over the elements, in no particular order. Like the iterators of the
+     * other containers, it stays valid for as long as the version of the map it came from.
+     */
+    class const_iterator : public std::iterator<std::forward_iterator_tag,
+                                                value_type,
+                                                std::ptrdiff_t,
+                                                const value_type*,
+                                                const value_type&> {
+    public:
+        const_iterator() : _depth(0) {}
+
+        const_iterator& operator++() {
+            ++_path[_depth - 1].i;
+            settle();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator tmp(*this);
+            operator++();
+            return tmp;
+        }
+        bool operator==(const const_iterator& rhs) const {
+            return _depth == rhs._depth &&
+                (!_depth || (_path[_depth - 1].n == rhs._path[_depth - 1].n &&
+                             _path[_depth - 1].i == rhs._path[_depth - 1].i));
+        }
+        bool operator!=(const const_iterator& rhs) const {
+            return !(*this == rhs);
+        }
+        const value_type& operator*() const {
+            const frame& f = _path[_depth - 1];
+            return f.n->v()[f.i];
+        }
+        const value_type* operator->() const {
+            return &**this;
+        }
+
+    private:
+        friend class unordered_map;
+
+        /**
+         * A node on the path to the current element, and the position within it: the index of
+         * a value, or the number of values plus the index of the child being visited.
+         */
+        struct frame {
+            const node* n;
+            uint32_t i;
+        };
+
+        void push(const node* n, uint32_t i) {
+            _path[_depth].n = n;
+            _path[_depth].i = i;
+            ++_depth;
+        }
+
+        /**
+         * Moves from the position in the innermost frame to the next value, descending into
+         * children and returning to parents as needed.
+         */
+        void settle() {
+            while (_depth) {
+                frame& f = _path[_depth - 1];
+                if (f.i < f.n->_values)
+                    return;
+                if (f.i < f.n->_values + f.n->_children) {
+                    push(f.n->c()[f.i - f.n->_values], 0);
+                } else if (--_depth) {
+                    ++_path[_depth - 1].i;
+                }
+            }
+        }
+
+        frame _path[max_depth];
+        unsigned _depth;
+    };
+    typedef const_iterator iterator;
+
+    explicit unordered_map(const Hash& hash = Hash(),
+                           const KeyEqual& eq = KeyEqual(),
+                           const Allocator& a = Allocator())
+        : _root(nullptr), _size(0), _hash(hash), _eq(eq), _alloc(a){};
+    unordered_map(const unordered_map& x)
+        : _root(ref(x._root)), _size(x._size), _hash(x._hash), _eq(x._eq), _alloc(x._alloc) {}
+    unordered_map(unordered_map&& x)
+        : _root(x._root), _size(x._size), _hash(x._hash), _eq(x._eq), _alloc(x._alloc) {
+        x._root = nullptr;
+        x._size = 0;
+    }
+    unordered_map& operator=(unordered_map x) {
+        swap(x);
+        return *this;
+    }
+    ~unordered_map() {
+        unref(_root);
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return _alloc;
+    }
+
+    // iterators:
+    const_iterator begin() const {
+        const_iterator i;
+        if (_root) {
+            i.push(_root, 0);
+            i.settle();
+        }
+        return i;
+    }
+    const_iterator end() const {
+        return const_iterator();
+    }
+
+    // capacity:
+    bool empty() const noexcept {
+        return size() == 0;
+    };
+
+    size_type size() const noexcept {
+        return _size;
+    };
+
+    // element access:
+    const T& at(const key_type& x) const {
+        const_iterator i = find(x);
+        if (i == end())
+            throw std::out_of_range("persistent::unordered_map::at");
+        return i->second;
+    }
+
+    // modifiers:
+    /**
+     * Inserts x unless its key is already present. Returns an iterator to the element with the
+     * key of x, and whether x was inserted.
+     */
+    std::pair<const_iterator, bool> insert(const value_type& x) {
+        return insert(x, false);
+    }
+    /**
+     * Maps k to obj, inserting it if not present. Returns an iterator to the element and whether
+     * it was inserted. Assigning a value equal to the current one leaves the map unchanged.
+     */
+    std::pair<const_iterator, bool> insert_or_assign(const key_type& k, const T& obj) {
+        return insert(value_type(k, obj), true);
+    }
+
+    size_type erase(const key_type& x) {
+        if (!_root)
+            return 0;
+        bool erased = false;
+        owned root(erase(_root, x, _hash(x), 0, erased), *this);
+        if (!erased)
+            return 0;
+        // A subtree promoted to the root keeps the bitmap of its old level, so rebuild it.
+        if (root.get() && root.get()->_values == 1 && !root.get()->_children) {
+            owned single(singleton(root.get()->v()[0]), *this);
+            root.swap(single);
+        }
+        unref(_root);
+        _root = root.take();
+        --_size;
+        return 1;
+    }
+
+    void swap(unordered_map& x) {
+        std::swap(_root, x._root);
+        std::swap(_size, x._size);
+        std::swap(_hash, x._hash);
+        std::swap(_eq, x._eq);
+        std::swap(_alloc, x._alloc);
+    }
+    void clear() noexcept {
+        unref(_root);
+        _root = nullptr;
+        _size = 0;
+    }
+
+    // observers:
+    hasher hash_function() const {
+        return _hash;
+    }
+    key_equal key_eq() const {
+        return _eq;
+    }
+
+    // lookup:
+    const_iterator find(const key_type& x) const {
+        const_iterator i;
+        size_t hash = _hash(x);
+        const node* n = _root;
+        for (unsigned shift = 0; n; shift += bits_per_level) {
+            if (shift >= hash_bits) {
+                for (uint32_t pos = 0; pos < n->_values; ++pos) {
+                    if (_eq(n->v()[pos].first, x)) {
+                        i.push(n, pos);
+                        return i;
+                    }
+                }
+                return end();
+            }
+            uint32_t b = bit(hash, shift);
+            if (n->_datamap & b) {
+                uint32_t pos = node::index(n->_datamap, b);
+                if (!_eq(n->v()[pos].first, x))
+                    return end();
+                i.push(n, pos);
+                return i;
+            }
+            if (!(n->_nodemap & b))
+                return end();
+            uint32_t pos = node::index(n->_nodemap, b);
+            i.push(n, n->_values + pos);
+            n = n->c()[pos];
+        }
+        return end();
+    }
+    size_type count(const key_type& x) const {
+        return find(x) != end();
+    }
+    /**
+     * Calls f for each element, in no particular order, in O(n).
+     */
+    template <class F>
+    void for_each(F f) const {
+        visit(_root, f);
+    }
+
+private:
+    /**
+     * Holds a reference to a node, releasing it unless taken, so that nodes built while copying
+     * a path are not leaked when copying a value throws.
+     */
+    class owned {
+    public:
+        owned(node* n, const unordered_map& m) : _n(n), _m(m) {}
+        owned(const owned&) = delete;
+        ~owned() {
+            _m.unref(_n);
+        }
+
+        node* get() const {
+            return _n;
+        }
+        node* take() {
+            node* n = _n;
+            _n = nullptr;
+            return n;
+        }
+        void swap(owned& x) {
+            std::swap(_n, x._n);
+        }
+
+    private:
+        node* _n;
+        const unordered_map& _m;
+    };
+
+    /**
+     * How a node is derived from another: a value or child is kept, inserted, removed or
+     * replaced at a position.
+     */
+    enum edit { keep, insert_at, remove_at, replace_at };
+
+    template <class X>
+    static const X& pick(const X* old, edit e, uint32_t pos, const X* x, uint32_t k) {
+        switch (e) {
+            case insert_at:
+                return k < pos ? old[k] : k == pos ? *x : old[k - 1];
+            case remove_at:
+                return k < pos ? old[k] : old[k + 1];
+            case replace_at:
+                return k == pos ? *x : old[k];
+            default:
+                return old[k];
+        }
+    }
+
+    static uint32_t bit(size_t hash, unsigned shift) {
+        return uint32_t(1) << ((hash >> shift) & ((1 << bits_per_level) - 1));
+    }
+
+    static node* ref(node* n) {
+        if (n)
+            n->_refs.fetch_add(1, std::memory_order_relaxed);
+        return n;
+    }
+
+    void unref(node* n) const {
+        if (!n || n->_refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        for (uint32_t i = 0; i < n->_children; ++i)
+            unref(n->c()[i]);
+        for (uint32_t i = 0; i < n->_values; ++i)
+            n->v()[i].~value();
+        deallocate(n);
+    }
+
+    static size_t units(const node* n) {
+        return (node::bytes(n->_values, n->_children) + sizeof(unit) - 1) / sizeof(unit);
+    }
+
+    void deallocate(node* n) const {
+        size_t count = units(n);
+        n->~node();
+        unit_allocator a(_alloc);
+        a.deallocate(reinterpret_cast<unit*>(n), count);
+    }
+
+    /**
+     * Returns a new node with the given bitmaps, holding values value_at(k) for k < values and
+     * children child_at(k) for k < children, to which it adds a reference.
+     */
+    template <class V, class C>
+    node* build(uint32_t datamap,
+                uint32_t nodemap,
+                uint32_t values,
+                uint32_t children,
+                V value_at,
+                C child_at) const {
+        unit_allocator a(_alloc);
+        size_t count = (node::bytes(values, children) + sizeof(unit) - 1) / sizeof(unit);
+        node* n = new (a.allocate(count)) node(datamap, nodemap, values, children);
+        uint32_t k = 0;
+        try {
+            for (; k < values; ++k)
+                new (&n->v()[k]) value(value_at(k));
+        } catch (...) {
+            while (k)
+                n->v()[--k].~value();
+            deallocate(n);
+            throw;
+        }
+        for (k = 0; k < children; ++k)
+            n->c()[k] = ref(child_at(k));
+        return n;
+    }
+
+    /**
+     * Returns a copy of n with the given bitmaps, edited at position vpos of its values and at
+     * position cpos of its children.
+     */
+    node* copy(const node& n,
+               uint32_t datamap,
+               uint32_t nodemap,
+               edit ve,
+               uint32_t vpos,
+               const value* v,
+               edit ce = keep,
+               uint32_t cpos = 0,
+               node* c = nullptr) const {
+        uint32_t values = n._values + (ve == insert_at) - (ve == remove_at);
+        uint32_t children = n._children + (ce == insert_at) - (ce == remove_at);
+        node* const* old = n.c();
+        return build(
+            datamap,
+            nodemap,
+            values,
+            children,
+            [&](uint32_t k) -> const value& { return pick(n.v(), ve, vpos, v, k); },
+            [&](uint32_t k) { return pick(old, ce, cpos, &c, k); });
+    }
+
+    static node* no_child(uint32_t) {
+        return nullptr;
+    }
+
+    node* singleton(const value& v) const {
+        return build(bit(_hash(v.first), 0),
+                     0,
+                     1,
+                     0,
+                     [&](uint32_t) -> const value& { return v; },
+                     no_child);
+    }
+
+    /**
+     * Returns a node holding both a and b, which differ but agree on the hash bits below shift.
+     */
+    node* merge(const value& a, size_t ha, const value& b, size_t hb, unsigned shift) const {
+        uint32_t ba = shift < hash_bits ? bit(ha, shift) : 0;
+        uint32_t bb = shift < hash_bits ? bit(hb, shift) : 0;
+        if (shift < hash_bits && ba == bb) {
+            owned child(merge(a, ha, b, hb, shift + bits_per_level), *this);
+            node* c = child.get();
+            return build(0,
+                         ba,
+                         0,
+                         1,
+                         [&](uint32_t) -> const value& { return a; },
+                         [&](uint32_t) { return c; });
+        }
+        // Past the last level, both go into a collision node with an empty datamap.
+        bool a_first = ba <= bb;
+        return build(ba | bb,
+                     0,
+                     2,
+                     0,
+                     [&](uint32_t k) -> const value& { return (k == 0) == a_first ? a : b; },
+                     no_child);
+    }
+
+    std::pair<const_iterator, bool> insert(const value_type& x, bool assign) {
+        bool inserted = false;
+        if (!_root) {
+            _root = singleton(x);
+            inserted = true;
+        } else if (node* root = insert(_root, x, _hash(x.first), 0, assign, inserted)) {
+            unref(_root);
+            _root = root;
+        }
+        _size += inserted;
+        return std::make_pair(find(x.first), inserted);
+    }
+
+    template <class F>
+    static void visit(const node* n, F& f) {
+        if (!n)
+            return;
+        for (uint32_t i = 0; i < n->_values; ++i)
+            f(n->v()[i]);
+        for (uint32_t i = 0; i < n->_children; ++i)
+            visit(n->c()[i], f);
+    }
+
+    /**
+     * Returns n with v inserted, or a null pointer if n is unchanged. If an element with the same
+     * key exists, n is unchanged unless assign is true and its value differs from that of v, in
+     * which case it is replaced.
+     */
+    node* insert(const node* n,
+                 const value& v,
+                 size_t hash,
+                 unsigned shift,
+                 bool assign,
+                 bool& inserted) const {
+        if (shift >= hash_bits) {
+            for (uint32_t pos = 0; pos < n->_values; ++pos)
+                if (_eq(n->v()[pos].first, v.first))
+                    return !assign || detail::same_value(n->v()[pos].second, v.second)
+                        ? nullptr
+                        : copy(*n, 0, 0, replace_at, pos, &v);
+            inserted = true;
+            return copy(*n, 0, 0, insert_at, n->_values, &v);
+        }
+        uint32_t b = bit(hash, shift);
+        if (n->_datamap & b) {
+            uint32_t pos = node::index(n->_datamap, b);
+            const value& e = n->v()[pos];
+            if (_eq(e.first, v.first))
+                return !assign || detail::same_value(e.second, v.second)
+                    ? nullptr
+                    : copy(*n, n->_datamap, n->_nodemap, replace_at, pos, &v);
+            inserted = true;
+            owned child(merge(e, _hash(e.first), v, hash, shift + bits_per_level), *this);
+            uint32_t nodemap = n->_nodemap | b;
+            return copy(*n,
+                        n->_datamap & ~b,
+                        nodemap,
+                        remove_at,
+                        pos,
+                        nullptr,
+                        insert_at,
+                        node::index(nodemap, b),
+                        child.get());
+        }
+        if (n->_nodemap & b) {
+            uint32_t pos = node::index(n->_nodemap, b);
+            owned child(
+                insert(n->c()[pos], v, hash, shift + bits_per_level, assign, inserted), *this);
+            if (!child.get())
+                return nullptr;
+            return copy(*n,
+                        n->_datamap,
+                        n->_nodemap,
+                        keep,
+                        0,
+                        nullptr,
+                        replace_at,
+                        pos,
+                        child.get());
+        }
+        inserted = true;
+        return copy(*n, n->_datamap | b, n->_nodemap, insert_at, node::index(n->_datamap, b), &v);
+    }
+
+    /**
+     * Sets erased if n holds x, and then returns n without x, or a null pointer if that leaves n
+     * empty. A subtree reduced to a single value is inlined into its parent, so lookups do not
+     * descend into nodes holding just one value.
+     */
+    node* erase(
+        const node* n, const key_type& x, size_t hash, unsigned shift, bool& erased) const {
+        if (shift >= hash_bits) {
+            for (uint32_t pos = 0; pos < n->_values; ++pos) {
+                if (_eq(n->v()[pos].first, x)) {
+                    erased = true;
+                    return n->_values == 1 ? nullptr : copy(*n, 0, 0, remove_at, pos, nullptr);
+                }
+            }
+            return nullptr;
+        }
+        uint32_t b = bit(hash, shift);
+        if (n->_datamap & b) {
+            uint32_t pos = node::index(n->_datamap, b);
+            if (!_eq(n->v()[pos].first, x))
+                return nullptr;
+            erased = true;
+            if (n->_values == 1 && !n->_children)
+                return nullptr;
+            return copy(*n, n->_datamap & ~b, n->_nodemap, remove_at, pos, nullptr);
+        }
+        if (!(n->_nodemap & b))
+            return nullptr;
+        uint32_t pos = node::index(n->_nodemap, b);
+        owned child(erase(n->c()[pos], x, hash, shift + bits_per_level, erased), *this);
+        if (!erased)
+            return nullptr;
+        const node* c = child.get();
+        bool inline_child = !c || (c->_values == 1 && !c->_children);
+        if (inline_child && !n->_values && n->_children == 1)
+            return child.take();
+        if (!inline_child)
+            return copy(*n,
+                        n->_datamap,
+                        n->_nodemap,
+                        keep,
+                        0,
+                        nullptr,
+                        replace_at,
+                        pos,
+                        child.get());
+        if (!c)
+            return copy(
+                *n, n->_datamap, n->_nodemap & ~b, keep, 0, nullptr, remove_at, pos, nullptr);
+        return copy(*n,
+                    n->_datamap | b,
+                    n->_nodemap & ~b,
+                    insert_at,
+                    node::index(n->_datamap, b),
+                    &c->v()[0],
+                    remove_at,
+                    pos,
+                    nullptr);
+    }
+
+    node* _root;
+    size_type _size;
+    Hash _hash;
+    KeyEqual _eq;
+    Allocator _alloc;
+};
+}
+
+#endif
@@ -0,0 +1,500 @@
+//
+//  persistent_vector.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_VECTOR_H
+#define PERSISTENT_VECTOR_H
+
+#include <algorithm>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "persistent_tree.h"
+
+namespace persistent {
+/**
+ * Sequence kept as a tree of chunks of up to 32 elements, sharing the tree engine of map with
+ * chunks ordered by position instead of by key, plus a last chunk held apart as a tail. The tree
+ * has a node per chunk rather than per element, so indexing descends O(log(n / 32)) nodes, and
+ * push_back copies only the tail until it is full, when it is linked into the tree as one node.
+ * Insertion and erasure at any position, concatenation and slicing take O(log n) and copy at
+ * most a chunk or two besides the path to them; everything else is shared with the previous
+ * version. Chunks left partly filled by these operations stay so, as in a relaxed radix tree.
+ */
+template <class T, class Allocator = std::allocator<T>>
+class vector {
+    static const size_t width = 32;
+
+    /**
+     * A run of up to width elements, immutable once built and shared by every version whose
+     * tree or tail refers to it.
+     */
+    struct chunk {
+        chunk() : _size(0) {}
+        chunk(const chunk&) = delete;
+        chunk& operator=(const chunk&) = delete;
+        ~chunk() {
+            while (_size)
+                reinterpret_cast<T*>(&_items[--_size])->~T();
+        }
+        const T& operator[](size_t i) const {
+            return *reinterpret_cast<const T*>(&_items[i]);
+        }
+        void push(const T& x) {
+            ::new (static_cast<void*>(&_items[_size])) T(x);
+            ++_size;
+        }
+
+        size_t _size;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type _items[width];
+    };
+    typedef std::shared_ptr<const chunk> chunk_ptr;
+
+    /**
+     * Augmentation counting the elements in the chunks of a subtree, by which elements are
+     * found; the size kept by the tree itself counts chunks.
+     */
+    struct element_count {
+        template <class Node>
+        void update(const Node& n) {
+            _count = count(n.left()) + n._v->_size + count(n.right());
+        }
+        template <class Node>
+        static size_t count(const Node* n) {
+            return n ? n->_count : 0;
+        }
+
+        size_t _count;
+    };
+
+    typedef detail::tree<chunk_ptr,
+                         chunk_ptr,
+                         detail::identity<chunk_ptr>,
+                         std::less<chunk_ptr>,
+                         Allocator,
+                         element_count>
+        tree;
+    typedef typename tree::node node;
+
+    /**
+     * Returns the chunk of the tree rooted at x holding the element at index n, setting rank to
+     * the index of the chunk and n to the offset of the element in it.
+     */
+    static const chunk& find(const node* x, size_t& n, size_t& rank) {
+        rank = 0;
+        for (;;) {
+            size_t left = element_count::count(x->left());
+            if (n < left) {
+                x = x->left();
+            } else if (n - left < x->_v->_size) {
+                n -= left;
+                rank += node::size(x->_l);
+                return *x->_v;
+            } else {
+                n -= left + x->_v->_size;
+                rank += node::size(x->_l) + 1;
+                x = x->right();
+            }
+        }
+    }
+
+public:
+    // types:
+    typedef T value_type;
+    typedef Allocator allocator_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    /**
+     * Iterators are an index into a version of the vector, given by its tree and tail: they stay
+     * valid for as long as that version, and support random access in O(log(n / 32)).
+     */
+    class const_iterator : public std::iterator<std::random_access_iterator_tag,
+                                                T,
+                                                std::ptrdiff_t,
+                                                const T*,
+                                                const T&> {
+    public:
+        const_iterator() : _root(nullptr), _tail(nullptr), _split(0), _index(0) {}
+
+        const_iterator& operator++() {
+            ++_index;
+            return *this;
+        }
+        const_iterator& operator--() {
+            --_index;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator tmp(*this);
+            operator++();
+            return tmp;
+        }
+        const_iterator operator--(int) {
+            const_iterator tmp(*this);
+            operator--();
+            return tmp;
+        }
+        const_iterator& operator+=(std::ptrdiff_t n) {
+            _index += n;
+            return *this;
+        }
+        const_iterator& operator-=(std::ptrdiff_t n) {
+            _index -= n;
+            return *this;
+        }
+        const_iterator operator+(std::ptrdiff_t n) const {
+            return const_iterator(_root, _tail, _split, _index + n);
+        }
+        const_iterator operator-(std::ptrdiff_t n) const {
+            return const_iterator(_root, _tail, _split, _index - n);
+        }
+        std::ptrdiff_t operator-(const const_iterator& rhs) const {
+            return std::ptrdiff_t(_index - rhs._index);
+        }
+        bool operator==(const const_iterator& rhs) const {
+            return _index == rhs._index;
+        }
+        bool operator!=(const const_iterator& rhs) const {
+            return _index != rhs._index;
+        }
+        bool operator<(const const_iterator& rhs) const {
+            return _index < rhs._index;
+        }
+        bool operator>(const const_iterator& rhs) const {
+            return _index > rhs._index;
+        }
+        bool operator<=(const const_iterator& rhs) const {
+            return _index <= rhs._index;
+        }
+        bool operator>=(const const_iterator& rhs) const {
+            return _index >= rhs._index;
+        }
+
+        const T& operator*() const {
+            return (*this)[0];
+        }
+        const T* operator->() const {
+            return &(*this)[0];
+        }
+        const T& operator[](std::ptrdiff_t n) const {
+            size_t i = _index + n;
+            if (i >= _split)
+                return (*_tail)[i - _split];
+            size_t rank;
+            const chunk& c = find(_root, i, rank);
+            return c[i];
+        }
+
+        /**
+         * Returns the zero-based index of the element referenced by this iterator.
+         */
+        size_t index() const {
+            return _index;
+        }
+
+    private:
+        friend class vector;
+
+        const_iterator(const node* root, const chunk* tail, size_t split, size_t index)
+            : _root(root), _tail(tail), _split(split), _index(index) {}
+
+        const node* _root;
+        const chunk* _tail;
+        size_t _split;
+        size_t _index;
+    };
+    typedef const_iterator iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    explicit vector(const Allocator& a = Allocator()) : _t(std::less<chunk_ptr>(), a){};
+    template <class InputIterator>
+    vector(InputIterator first, InputIterator last, const Allocator& a = Allocator())
+        : _t(std::less<chunk_ptr>(), a) {
+        for (; first != last; ++first)
+            push_back(*first);
+    }
+    vector(std::initializer_list<value_type> il, const Allocator& a = Allocator())
+        : _t(std::less<chunk_ptr>(), a) {
+        for (const value_type& x : il)
+            push_back(x);
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return _t.get_allocator();
+    }
+
+    // iterators:
+    const_iterator begin() const noexcept {
+        return iterator_at(0);
+    }
+    const_iterator end() const noexcept {
+        return iterator_at(size());
+    }
+    const_reverse_iterator rbegin() const noexcept {
+        return const_reverse_iterator(end());
+    }
+    const_reverse_iterator rend() const noexcept {
+        return const_reverse_iterator(begin());
+    }
+
+    // capacity:
+    bool empty() const noexcept {
+        return size() == 0;
+    };
+    size_type size() const noexcept {
+        return split() + (_tail ? _tail->_size : 0);
+    };
+    size_type max_size() const noexcept {
+        return std::numeric_limits<size_type>::max();
+    }
+
+    // element access:
+    const_reference operator[](size_type n) const {
+        return iterator_at(n)[0];
+    }
+    const_reference at(size_type n) const {
+        if (n >= size())
+            throw std::out_of_range("persistent::vector::at");
+        return iterator_at(n)[0];
+    }
+    const_reference front() const {
+        return *begin();
+    }
+    const_reference back() const {
+        return iterator_at(size() - 1)[0];
+    }
+
+    // modifiers:
+    /**
+     * Appends x to the tail, linking the tail into the tree once it holds width elements.
+     */
+    void push_back(const value_type& x) {
+        size_type s = _tail ? _tail->_size : 0;
+        if (s > 0 && s < width) {
+            const chunk& c = *_tail;
+            _tail = make_chunk(s + 1, [&](size_t i) -> const T& { return i < s ? c[i] : x; });
+            return;
+        }
+        chunk_ptr tail = make_chunk(1, [&](size_t) -> const T& { return x; });
+        if (_tail)
+            _t.insert_at(_t.size(), _tail);
+        _tail = tail;
+    }
+    void pop_back() {
+        if (!_tail)
+            _tail = _t.extract_at(_t.size() - 1)->_v;
+        size_type s = _tail->_size - 1;
+        _tail = s ? slice(*_tail, 0, s) : chunk_ptr();
+    }
+    /**
+     * Replaces the element at position n, copying only its chunk and the path to it.
+     */
+    void set(size_type n, const value_type& x) {
+        size_type split = this->split();
+        if (n >= split) {
+            _tail = replace(*_tail, n - split, x);
+            return;
+        }
+        size_type rank;
+        const chunk& c = find(_t.root(), n, rank);
+        _t.assign_at(rank, replace(c, n, x));
+    }
+    /**
+     * Inserts x before position, splitting its chunk in two if it is full.
+     */
+    iterator insert(const_iterator position, const value_type& x) {
+        size_type n = position.index(), split = this->split();
+        if (n >= split) {
+            std::pair<chunk_ptr, chunk_ptr> p = insert(_tail.get(), n - split, x, width);
+            if (p.second)
+                _t.insert_at(_t.size(), p.first);
+            _tail = p.second ? p.second : p.first;
+            return iterator_at(position.index());
+        }
+        size_type rank;
+        const chunk& c = find(_t.root(), n, rank);
+        std::pair<chunk_ptr, chunk_ptr> p = insert(&c, n, x, (c._size + 1) / 2);
+        tree t(_t);
+        t.assign_at(rank, p.first);
+        if (p.second)
+            t.insert_at(rank + 1, p.second);
+        _t.swap(t);
+        return iterator_at(position.index());
+    }
+    iterator erase(const_iterator position) {
+        size_type n = position.index(), split = this->split();
+        if (n >= split) {
+            _tail = erase(*_tail, n - split);
+            return iterator_at(position.index());
+        }
+        size_type rank;
+        const chunk& c = find(_t.root(), n, rank);
+        if (c._size == 1)
+            _t.erase_at(rank);
+        else
+            _t.assign_at(rank, erase(c, n));
+        return iterator_at(position.index());
+    }
+    /**
+     * Appends all elements of x, sharing its chunks, in O(log n). The tail of this vector is
+     * merged into the first chunk of x when both fit in one.
+     */
+    void append(const vector& x) {
+        if (x.empty())
+            return;
+        tree t(_t), u(x._t);
+        chunk_ptr tail = x._tail;
+        if (_tail) {
+            const chunk& next = u.size() ? *(*u.root() + 0)->_v : *tail;
+            if (_tail->_size + next._size <= width) {
+                chunk_ptr c = join(*_tail, next);
+                if (u.size())
+                    u.assign_at(0, c);
+                else
+                    tail = c;
+            } else {
+                t.insert_at(t.size(), _tail);
+            }
+        }
+        t.append(u);
+        _t.swap(t);
+        _tail = tail;
+    }
+    /**
+     * Returns the elements with index in [first, last), sharing all chunks but the first and
+     * the last with this vector.
+     */
+    vector slice(size_type first, size_type last) const {
+        vector v(*this);
+        last = std::min(last, size());
+        size_type split = this->split();
+        if (first >= last) {
+            v.clear();
+            return v;
+        }
+        v._tail.reset();
+        if (last > split)
+            v._tail = slice(*_tail, first > split ? first - split : 0, last - split);
+        if (first >= split) {
+            v._t.clear();
+            return v;
+        }
+        size_type head = first, rest = std::min(last, split) - 1, k, l;
+        const chunk& c = find(_t.root(), head, k);
+        const chunk& d = find(_t.root(), rest, l);
+        v._t.slice(k, l + 1);
+        if (k == l) {
+            if (head > 0 || rest + 1 < c._size)
+                v._t.assign_at(0, slice(c, head, rest + 1));
+            return v;
+        }
+        if (head > 0)
+            v._t.assign_at(0, slice(c, head, c._size));
+        if (rest + 1 < d._size)
+            v._t.assign_at(l - k, slice(d, 0, rest + 1));
+        return v;
+    }
+    void swap(vector& x) {
+        _t.swap(x._t);
+        _tail.swap(x._tail);
+    }
+    void clear() noexcept {
+        _t.clear();
+        _tail.reset();
+    }
+
+private:
+    /**
+     * Returns the number of elements in the tree, which precede those in the tail.
+     */
+    size_type split() const noexcept {
+        return element_count::count(_t.root());
+    }
+
+    const_iterator iterator_at(size_type n) const noexcept {
+        return const_iterator(_t.root(), _tail.get(), split(), n);
+    }
+
+    /**
+     * Builds a chunk of n elements obtained from f(i) for each index i.
+     */
+    template <class F>
+    chunk_ptr make_chunk(size_type n, F f) const {
+        std::shared_ptr<chunk> c = std::allocate_shared<chunk>(_t.get_allocator());
+        for (size_type i = 0; i < n; ++i)
+            c->push(f(i));
+        return c;
+    }
+
+    chunk_ptr slice(const chunk& c, size_type first, size_type last) const {
+        return make_chunk(last - first, [&](size_t i) -> const T& { return c[first + i]; });
+    }
+
+    chunk_ptr replace(const chunk& c, size_type n, const value_type& x) const {
+        return make_chunk(c._size, [&](size_t i) -> const T& { return i == n ? x : c[i]; });
+    }
+
+    /**
+     * Returns c without its element at n, or no chunk if that was its only element.
+     */
+    chunk_ptr erase(const chunk& c, size_type n) const {
+        if (c._size == 1)
+            return chunk_ptr();
+        return make_chunk(c._size - 1, [&](size_t i) -> const T& { return c[i < n ? i : i + 1]; });
+    }
+
+    chunk_ptr join(const chunk& c, const chunk& d) const {
+        size_type s = c._size;
+        return make_chunk(s + d._size,
+                          [&](size_t i) -> const T& { return i < s ? c[i] : d[i - s]; });
+    }
+
+    /**
+     * Returns the elements of c, which may be missing, with x inserted at n: as one chunk if they
+     * fit, or else as a chunk of the first half elements followed by one of the rest.
+     */
+    std::pair<chunk_ptr, chunk_ptr> insert(const chunk* c,
+                                           size_type n,
+                                           const value_type& x,
+                                           size_type half) const {
+        size_type s = c ? c->_size + 1 : 1;
+        auto at = [&](size_t i) -> const T& { return i < n ? (*c)[i] : i == n ? x : (*c)[i - 1]; };
+        if (s <= width)
+            return std::make_pair(make_chunk(s, at), chunk_ptr());
+        chunk_ptr first = make_chunk(half, at);
+        chunk_ptr rest = make_chunk(s - half, [&](size_t i) -> const T& { return at(half + i); });
+        return std::make_pair(first, rest);
+    }
+
+    tree _t;
+    chunk_ptr _tail;
+};
+
+template <class T, class Allocator>
+bool operator==(const vector<T, Allocator>& x, const vector<T, Allocator>& y) {
+    return x.size() == y.size() && std::equal(x.begin(), x.end(), y.begin());
+}
+template <class T, class Allocator>
+bool operator!=(const vector<T, Allocator>& x, const vector<T, Allocator>& y) {
+    return !(x == y);
+}
+
+template <class T, class Allocator>
+void swap(vector<T, Allocator>& x, vector<T, Allocator>& y) {
+    x.swap(y);
+}
+}
+
+#endif
@@ -0,0 +1,349 @@
+//
+//  persistent_view.h
+//  PersistentMap
+//
+//  Copyright © 2015 MongoDB. All rights reserved.
+//
+
+#ifndef PERSISTENT_VIEW_H
+#define PERSISTENT_VIEW_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace persistent {
+template <class View, class F>
+class transform_view;
+template <class View, class Pred>
+class filter_view;
+
+namespace detail {
+template <class F, class G>
+struct transform_then {
+    template <class X>
+    void operator()(const X& x) const {
+        _g(_f(x));
+    }
+
+    const F& _f;
+    G& _g;
+};
+
+template <class Pred, class G>
+struct filter_then {
+    template <class X>
+    void operator()(const X& x) const {
+        if (_p(x))
+            _g(x);
+    }
+
+    const Pred& _p;
+    G& _g;
+};
+
+/**
+ * Gives every view the adaptors that stack another view on top of it.
+ */
+template <class View>
+struct view_adaptors {
+    /**
+     * Returns a view of f(x) for each element x of this view.
+     */
+    template <class F>
+    transform_view<View, F> transform(F f) const {
+        return transform_view<View, F>(static_cast<const View&>(*this), f);
+    }
+    /**
+     * Returns a view of the elements x of this view for which p(x) is true.
+     */
+    template <class Pred>
+    filter_view<View, Pred> filter(Pred p) const {
+        return filter_view<View, Pred>(static_cast<const View&>(*this), p);
+    }
+};
+}
+
+/**
+ * View of the elements of a snapshot of a map with keys in a range. Like a copy of the map it
+ * takes O(1) to create, as it only holds the root of the snapshot and the ranks bounding the
+ * range. Iterators, indexing and for_each work as on the map itself, restricted to the range.
+ */
+template <class Map>
+class range_view : public detail::view_adaptors<range_view<Map>> {
+public:
+    // types:
+    typedef typename Map::key_type key_type;
+    typedef typename Map::value_type value_type;
+    typedef typename Map::const_iterator iterator;
+    typedef typename Map::const_iterator const_iterator;
+    typedef typename Map::size_type size_type;
+    typedef typename Map::difference_type difference_type;
+
+    explicit range_view(const Map& m) : _m(m), _first(0), _last(m.size()) {}
+    range_view(const Map& m, const key_type& first, const key_type& last)
+        : _m(m),
+          _first(m.lower_bound(first) - m.begin()),
+          _last(std::max(_first, size_type(m.lower_bound(last) - m.begin()))) {}
+
+    // iterators:
+    const_iterator begin() const {
+        return _m.begin() + _first;
+    }
+    const_iterator end() const {
+        return _m.begin() + _last;
+    }
+
+    // capacity:
+    bool empty() const {
+        return size() == 0;
+    }
+    size_type size() const {
+        return _last - _first;
+    }
+
+    // element access:
+    const value_type& operator[](size_type n) const {
+        return begin()[n];
+    }
+
+    // view operations:
+    /**
+     * Returns the first element not less than x, or end() if there is none in the view.
+     */
+    const_iterator lower_bound(const key_type& x) const {
+        return clamp(_m.lower_bound(x));
+    }
+    const_iterator upper_bound(const key_type& x) const {
+        return clamp(_m.upper_bound(x));
+    }
+    const_iterator find(const key_type& x) const {
+        const_iterator i = _m.find(x);
+        return i < begin() || i >= end() ? end() : i;
+    }
+    /**
+     * Returns the part of this view with keys in [first, last).
+     */
+    range_view range(const key_type& first, const key_type& last) const {
+        range_view v(*this);
+        v._first = lower_bound(first) - _m.begin();
+        v._last = std::max(v._first, size_type(lower_bound(last) - _m.begin()));
+        return v;
+    }
+    /**
+     * Returns the part of this view with index in [first, last).
+     */
+    range_view slice(size_type first, size_type last) const {
+        range_view v(*this);
+        v._last = _first + std::min(last, size());
+        v._first = std::min(_first + first, v._last);
+        return v;
+    }
+    /**
+     * Calls f for each element in order, in O(log n + k) for k elements.
+     */
+    template <class F>
+    void for_each(F f) const {
+        _m.for_each(begin(), end(), f);
+    }
+
+private:
+    const_iterator clamp(const_iterator i) const {
+        return std::min(std::max(i, begin()), end());
+    }
+
+    Map _m;
+    size_type _first;
+    size_type _last;
+};
+
+/**
+ * View of f(x) for each element x of another view, computed whenever it is accessed. Keeps the
+ * size and indexing of the underlying view, but its iterators yield elements by value.
+ */
+template <class View, class F>
+class transform_view : public detail::view_adaptors<transform_view<View, F>> {
+    typedef typename View::const_iterator base_iterator;
+
+public:
+    // types:
+    typedef typename std::decay<decltype(
+        std::declval<const F&>()(std::declval<const typename View::value_type&>()))>::type
+        value_type;
+    typedef typename View::size_type size_type;
+
+    class iterator : public std::iterator<std::input_iterator_tag,
+                                          value_type,
+                                          std::ptrdiff_t,
+                                          void,
+                                          value_type> {
+    public:
+        iterator(base_iterator i, const F* f) : _i(i), _f(f) {}
+
+        iterator& operator++() {
+            ++_i;
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator tmp(*this);
+            ++_i;
+            return tmp;
+        }
+        bool operator==(const iterator& rhs) const {
+            return _i == rhs._i;
+        }
+        bool operator!=(const iterator& rhs) const {
+            return _i != rhs._i;
+        }
+        value_type operator*() const {
+            return (*_f)(*_i);
+        }
+
+        base_iterator base() const {
+            return _i;
+        }
+
+    private:
+        base_iterator _i;
+        const F* _f;
+    };
+    typedef iterator const_iterator;
+
+    transform_view(const View& v, const F& f) : _v(v), _f(f) {}
+
+    // iterators:
+    const_iterator begin() const {
+        return const_iterator(_v.begin(), &_f);
+    }
+    const_iterator end() const {
+        return const_iterator(_v.end(), &_f);
+    }
+
+    // capacity:
+    bool empty() const {
+        return _v.empty();
+    }
+    size_type size() const {
+        return _v.size();
+    }
+
+    // element access:
+    value_type operator[](size_type n) const {
+        return _f(_v[n]);
+    }
+
+    // view operations:
+    template <class G>
+    void for_each(G g) const {
+        detail::transform_then<F, G> h = {_f, g};
+        _v.for_each(h);
+    }
+
+private:
+    View _v;
+    F _f;
+};
+
+/**
+ * View of the elements x of another view for which p(x) is true, tested whenever the view is
+ * traversed. As the number of such elements is unknown, there is no size or indexing.
+ */
+template <class View, class Pred>
+class filter_view : public detail::view_adaptors<filter_view<View, Pred>> {
+    typedef typename View::const_iterator base_iterator;
+
+public:
+    // types:
+    typedef typename View::value_type value_type;
+    typedef size_t size_type;
+
+    class iterator : public std::iterator<std::input_iterator_tag,
+                                          value_type,
+                                          std::ptrdiff_t,
+                                          void,
+                                          typename std::iterator_traits<base_iterator>::reference> {
+    public:
+        iterator(base_iterator i, base_iterator last, const Pred* p) : _i(i), _last(last), _p(p) {
+            skip();
+        }
+
+        iterator& operator++() {
+            ++_i;
+            skip();
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator tmp(*this);
+            operator++();
+            return tmp;
+        }
+        bool operator==(const iterator& rhs) const {
+            return _i == rhs._i;
+        }
+        bool operator!=(const iterator& rhs) const {
+            return _i != rhs._i;
+        }
+        typename std::iterator_traits<base_iterator>::reference operator*() const {
+            return *_i;
+        }
+
+        base_iterator base() const {
+            return _i;
+        }
+
+    private:
+        void skip() {
+            while (_i != _last && !(*_p)(*_i))
+                ++_i;
+        }
+
+        base_iterator _i;
+        base_iterator _last;
+        const Pred* _p;
+    };
+    typedef iterator const_iterator;
+
+    filter_view(const View& v, const Pred& p) : _v(v), _p(p) {}
+
+    // iterators:
+    const_iterator begin() const {
+        return const_iterator(_v.begin(), _v.end(), &_p);
+    }
+    const_iterator end() const {
+        return const_iterator(_v.end(), _v.end(), &_p);
+    }
+
+    // view operations:
+    template <class G>
+    void for_each(G g) const {
+        detail::filter_then<Pred, G> h = {_p, g};
+        _v.for_each(h);
+    }
+
+private:
+    View _v;
+    Pred _p;
+};
+
+/**
+ * Returns a view of all elements of m.
+ */
+template <class Map>
+range_view<Map> view(const Map& m) {
+    return range_view<Map>(m);
+}
+
+/**
+ * Returns a view of the elements of m with keys in [first, last).
+ */
+template <class Map>
+range_view<Map> view(const Map& m,
+                     const typename Map::key_type& first,
+                     const typename Map::key_type& last) {
+    return range_view<Map>(m, first, last);
+}
+}
+
+#endif